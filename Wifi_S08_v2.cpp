@@ -8,7 +8,22 @@
 #include <WString.h>
 #include <Arduino.h>
 
+// Records how deep the ISR's stack goes, measured from its entry in
+// handleInterrupt() or handleInterruptAP().  Placed in the ISR's deepest
+// calls; does nothing outside the ISR.
+#define ESP_STACK_MARK() do { \
+    if (isrStackBase != 0) { \
+      size_t used = isrStackBase - (uintptr_t)__builtin_frame_address(0); \
+      if (used > isrStackPeak) { \
+        isrStackPeak = used; \
+      } \
+    } \
+  } while (0)
+
 ESP8266 * ESP8266::_instance;
+const char ESP_CONFIG = 0; // See Wifi_S08_v2.h
+template <> const char ESP_SIZES::check = 0;
+
 
 // Substrings to look for from AT command responses
 const char ESP8266::READY[] = "ready";
@@ -19,11 +34,84 @@ const char ESP8266::ERROR[] = "ERROR";
 const char ESP8266::FAIL[] = "FAIL";
 const char ESP8266::STATUS[] = "STATUS:";
 const char ESP8266::ALREADY_CONNECTED[] = "ALREADY CONNECTED";
-const char ESP8266::HTML_START[] = "<html>";
-const char ESP8266::HTML_END[] = "</html>";
 const char ESP8266::SEND_FAIL[] = "SEND FAIL";
 const char ESP8266::CLOSED[] = "CLOSED";
 const char ESP8266::UNLINK[] = "UNLINK";
+const char ESP8266::IPD_FRAME[] = "+IPD,";
+
+// Patterns for the token matcher, indexed by Token
+const char * const ESP8266::TOKENS[NUMBEROFTOKENS] = {
+  READY, OK, OK_PROMPT, SEND_OK, ERROR, FAIL, STATUS, ALREADY_CONNECTED,
+  SEND_FAIL, CLOSED, UNLINK, IPD_FRAME
+};
+// Startup scripts, run by the ISR one step at a time (see runScript()).  A
+// probe step queries a setting the modem keeps in flash; if the reply shows
+// it is already right, the steps that would set it are skipped.
+const ESP8266::ScriptStep ESP8266::RESET_STEPS[] = {
+  {AT_CWAUTOCONN, OK_TOK, CWAUTOCONN_TIMEOUT, 1, NULL, 0, 0},
+  {AT_CWMODE_GET, OK_TOK, CWMODE_TIMEOUT, 1, CWMODE_STATION, 1, STEP_OPTIONAL},
+  {AT_CWMODE, OK_TOK, CWMODE_TIMEOUT, 1, NULL, 0, 0},
+  {AT_RST, READY_TOK, RST_TIMEOUT, 1, NULL, 0, STEP_RESET},
+  {AT_CIPSSLSIZE, OK_TOK, AT_TIMEOUT, 1, NULL, 0, STEP_OPTIONAL},
+  {AT_CIPMUX, OK_TOK, CIPMUX_TIMEOUT, 1, NULL, 0, 0},
+  {NULL, OK_TOK, 0, 0, NULL, 0, 0}
+};
+// As RESET_STEPS, but the modem is only restarted if its mode was wrong.
+// Links may be left open from before the Teensy restarted, so close them.
+const ESP8266::ScriptStep ESP8266::STATION_STEPS[] = {
+  {AT_BASIC, OK_TOK, AT_TIMEOUT, AT_TRIES, NULL, 0, STEP_ABORT},
+  {AT_CWAUTOCONN, OK_TOK, CWAUTOCONN_TIMEOUT, 1, NULL, 0, 0},
+  {AT_CWMODE_GET, OK_TOK, CWMODE_TIMEOUT, 1, CWMODE_STATION, 2, STEP_OPTIONAL},
+  {AT_CWMODE, OK_TOK, CWMODE_TIMEOUT, 1, NULL, 0, 0},
+  {AT_RST, READY_TOK, RST_TIMEOUT, 1, NULL, 0, STEP_RESET},
+  {AT_CIPAPMAC, OK_TOK, MAC_TIMEOUT, 1, NULL, 0, STEP_MAC},
+  {AT_CIPSSLSIZE, OK_TOK, AT_TIMEOUT, 1, NULL, 0, STEP_OPTIONAL},
+  {AT_CIPMUX_GET, OK_TOK, CIPMUX_TIMEOUT, 1, CIPMUX_ON, 1, STEP_OPTIONAL},
+  {AT_CIPMUX, OK_TOK, CIPMUX_TIMEOUT, 1, NULL, 0, 0},
+  {AT_CIPCLOSE_ALL, OK_TOK, CIPCLOSE_TIMEOUT, 1, NULL, 0, STEP_OPTIONAL},
+  {NULL, OK_TOK, 0, 0, NULL, 0, 0}
+};
+const ESP8266::ScriptStep ESP8266::RESTORE_STEPS[] = {
+  {AT_RESTORE, READY_TOK, RESTORE_TIMEOUT, 1, NULL, 0, STEP_RESET},
+  {NULL, OK_TOK, 0, 0, NULL, 0, 0}
+};
+const ESP8266::ScriptStep ESP8266::AP_STEPS[] = {
+  {AT_BASIC, OK_TOK, AT_TIMEOUT, AT_TRIES, NULL, 0, STEP_ABORT},
+  {AT_CWMODE_GET, OK_TOK, CWMODE_TIMEOUT, 1, CWMODE_AP, 2, STEP_OPTIONAL},
+  {AT_CWMODE_AP, OK_TOK, CWMODE_TIMEOUT, 1, NULL, 0, 0},
+  {AT_RST, READY_TOK, RST_TIMEOUT, 1, NULL, 0, STEP_RESET},
+  {NULL, OK_TOK, 0, 0, NULL, 0, 0}
+};
+const ESP8266::ScriptStep ESP8266::SERVER_STEPS[] = {
+  {AT_CWSAP_SET, OK_TOK, CWSAP_TIMEOUT, 1, NULL, 0, STEP_CWSAP},
+  {AT_CIPMUX_GET, OK_TOK, CIPMUX_TIMEOUT, 1, CIPMUX_ON, 1, STEP_OPTIONAL},
+  {AT_CIPMUX, OK_TOK, CIPMUX_TIMEOUT, 1, NULL, 0, 0},
+  {AT_CIPSERVER, OK_TOK, CIPSERVER_TIMEOUT, 1, NULL, 0, 0},
+  {AT_CIPAP_SET, OK_TOK, CIPAP_TIMEOUT, 1, NULL, 0, 0},
+  {NULL, OK_TOK, 0, 0, NULL, 0, 0}
+};
+// Indexed by Script, which is also the order pending scripts run in
+const ESP8266::ScriptStep * const ESP8266::SCRIPTS[NUMBEROFSCRIPTS] = {
+  RESTORE_STEPS, RESET_STEPS, STATION_STEPS, AP_STEPS, SERVER_STEPS
+};
+const char * const ESP8266::SCRIPT_NAMES[NUMBEROFSCRIPTS] = {
+  "Restore", "Reset", "Startup", "Access point setup", "Server start"
+};
+// Order must match State and StateAP.  Each ends with NULL.
+const char * const ESP8266::STATE_NAMES[] = {
+  "IDLE", "CIPSTATUS", "CWJAP", "CIPSTART", "CIPSEND", "DATAOUT",
+#if ESP_UPLOADS
+  "CHUNKOUT",
+#endif
+  "AWAITRESPONSE", "CIPCLOSE", NULL
+};
+const char * const ESP8266::STATE_AP_NAMES[] = {
+  "AWAITCLIENT", "SENDRESPONSE", "DATAOUTAP", "CLOSE", NULL
+};
+
+ESP8266::MatchNode ESP8266::matcher[MATCHERNODES];
+uint8_t ESP8266::matcherSize = 0;
+uint8_t ESP8266::tokenLen[NUMBEROFTOKENS];
 
 // Constructors and init method
 ESP8266::ESP8266() {
@@ -40,21 +128,53 @@ ESP8266::ESP8266(int mode, bool verboseSerial) {
 }
 
 void ESP8266::init(int mode, bool verboseSerial) {
+#if !ESP_AP
+  mode = 0; // Station mode is the only one built in
+#elif !ESP_STATION
+  mode = 1;
+#endif
   _instance = this;
   serialYes = verboseSerial;
   state = IDLE;
   stateAP = AWAITCLIENT;
   ESPmode = mode;
-
-
+  scriptsPending = 0;
+  scriptRunning = -1;
+  scriptStep = 0;
+  stepSent = false; // tickState() reads these before any script runs
+  startupOk = true;
+  serverStatus = false;
+  isrStackBase = 0;
+  isrStackPeak = 0;
+#if ESP_PROFILE
+  memset(&profileData, 0, sizeof(profileData));
+  profileData.cyclesPerMicro = ESP_CYCLES_PER_SEC / 1000000;
+  profileSeq = 0;
+  profileClear = false;
+  profileRx = 0;
+  ESP_CYCLES_START();
+#endif
+#if ESP_METRICS
+  memset(&metricsData, 0, sizeof(metricsData));
+  metricsSeq = 0;
+  metricsClear = false;
+#endif
+  adaptiveTick = false;
+  tickWake = false;
+  tickMicros = 0;
+  quietTicks = 0;
+  rxSeen = false;
+  buildMatcher();
+  emptyRxAndBuffer();
+
+#if ESP_STATION
   if (ESPmode == 0){     //Station mode
-    hasRequest = false;
-    responseReady = false;
     connected = false;
-    dataReady = false;
     doAutoConn = true;
+    keepAlive = false;
+    keepAliveTimeout = KEEPALIVE_TIMEOUT;
     newNetworkInfo = false;
-    MAC = "";
+    MAC[0] = '\0';
     reqReconn = false;
 
     receiveCount = 0;
@@ -62,58 +182,101 @@ void ESP8266::init(int mode, bool verboseSerial) {
 
     ssid[0] = '\0';
     password[0] = '\0';
-    response[0] = '\0';
-
-    // Default initialization of request_p, to avoid NULL pointer exception
-    request_p = (volatile Request *)malloc(sizeof(Request));
-    request_p->domain[0] = '\0';
-    request_p->path[0] = '\0';
-    request_p->data[0] = '\0';
-    request_p->data[DATASIZE] = '\0';
-    request_p->data_ref = NULL;
-    request_p->data_len = 0;
-    request_p->data_offset = 0;
-    request_p->port = 0;
-    request_p->type = GET_REQ;
-    request_p->auto_retry = false;
-    request_p->ssl = false;
-    request_p->big = false;
-  }
-  else if(ESPmode == 1){  //Access Point mode
-    hasRequest = true;
-    responseReady = false;
+    response = storage.station.response;
+    response[0][0] = '\0';
+
+    requestHead = 0;
+    requestTail = 0;
+    requestNext = 0;
+    responseHead = 0;
+    responseTail = 0;
+    readingSlot = -1;
+    lastStatus = 0;
+#if ESP_TIMING
+    memset(&lastTiming, 0, sizeof(lastTiming));
+    memset(phaseTotals, 0, sizeof(phaseTotals));
+    timingSeq = 0;
+    timingClear = false;
+#endif
+#if ESP_STREAMING
+    streamBuffer = storage.station.stream;
+    streamActive = false;
+#endif
+    cancelRequested = false;
+    for (int i = 0; i < RESPONSEQUEUESIZE; i++) {
+      slotFree[i] = true;
+    }
+    activeLink = -1;
+    building = NULL;
+    for (int i = 0; i < STATIONLINKS; i++) {
+      links[i].state = IDLE;
+      links[i].request = NULL;
+      links[i].slot = -1;
+      links[i].closed = true;
+      links[i].retryWait = false;
+      resetReceive(i);
+    }
+
+    // Default initialization of the request ring, to avoid NULL pointer
+    // exception; request_p always points into it
+    requestQueue = storage.station.requests;
+    for (int i = 0; i < REQUESTQUEUESIZE; i++) {
+      request_p = &requestQueue[i];
+      request_p->domain[0] = '\0';
+      request_p->path[0] = '\0';
+      request_p->data[0] = '\0';
+      request_p->data[DATASIZE] = '\0';
+      request_p->port = 0;
+      request_p->type = GET_REQ;
+      request_p->auto_retry = false;
+      request_p->ssl = false;
+      request_p->ready = false;
+      request_p->done = true;
+    }
+    request_p = &requestQueue[0];
+  }
+#endif
+#if ESP_AP
+  if(ESPmode == 1){  //Access Point mode
     newNetworkInfo = false;
     serverStatus = false;
-    dataReady = false;
+    pagesBusy = false;
 
     receiveCount = 0;
     transmitCount = 0;
 
     ssid[0] = '\0';
     password[0] = '\0';
-    response[0] = '\0';
-
-    // Default initialization of request_p, to avoid NULL pointer exception
-    requestAP_p = (volatile RequestAP *)malloc(sizeof(RequestAP));
-    requestAP_p->path[0] = '\0';
-    requestAP_p->data[0] = '\0';
-    requestAP_p->data[DATASIZE] = '\0';
-    requestAP_p->typeAP = GET_REQ;
 
-    // Default initialization of pages
-    storedPages = (volatile Pages *)malloc(sizeof(Pages));
-    stringToVolatileArray(DEF_DIR, storedPages->directory, NUMBEROFPAGES*PAGESIZE);
-    stringToVolatileArray(DEF_HTML, storedPages->html, NUMBEROFPAGES*HTMLSTORAGE);
-
-    for(int i = 1;i < NUMBEROFPAGES; i++){
-      stringToVolatileArray("\0", storedPages->directory+i*PAGESIZE, NUMBEROFPAGES*PAGESIZE);
-      stringToVolatileArray("\0", storedPages->html+i*HTMLSTORAGE, NUMBEROFPAGES*HTMLSTORAGE);
+    clients = storage.ap.clients;
+    for (int i = 0; i < APLINKS; i++) {
+      clients[i].state = CLIENT_IDLE;
+      clients[i].request = storage.ap.requests[i];
+    }
+    activeClient = -1;
+    nextClient = 0;
+    for (int i = 0; i < APHELDREQUESTS; i++) {
+      heldRequests[i] = storage.ap.requests[APLINKS + i];
+      heldRequests[i][0] = '\0';
     }
+    memset(heldFields, 0, sizeof(heldFields));
+    heldHead = 0;
+    heldTail = 0;
+
+    // Default initialization of pages, served for unknown paths
+    storedPages = &storage.ap.pages;
+    storedPages->count = 0;
+    storedPages->used = 0;
+    memset((uint8_t *)storedPages->index, 0, ROUTEINDEXSIZE);
+    storePage(DEF_DIR, strlen(DEF_DIR), DEF_HTML, strlen(DEF_HTML), false,
+        NULL);
   }
+#endif
 }
 
+// Starts the ESP8266.  The startup script runs from the timer interrupt, so
+// this returns right away; see isStarting() and isStartupOk().
 void ESP8266::begin() {
-  delay(500);
   emptyRx();
   if (serialYes) {
     Serial.begin(115200);
@@ -122,23 +285,32 @@ void ESP8266::begin() {
   }
   wifiSerial.begin(115200);
   while (!wifiSerial); //Loop until wifiSerial is initialized
-  if (checkPresent()) {
-    Serial.print("6.S08 Wifi Library Loaded: V");
-    Serial.println(ESP_VERSION);
-    if(ESPmode == 0){
-      reset();
-      getMACFromDevice();
-      wifiSerial.println(AT_CIPSSLSIZE);
-      if (!waitForTarget(OK, AT_TIMEOUT)) Serial.println("SSL Buffer Size Failed");
-      emptyRx();
-    }
-    else if(ESPmode == 1){
-      startAP();
+  Serial.print("6.S08 Wifi Library Loaded: V");
+  Serial.println(ESP_VERSION);
+  startupOk = true;
+  requestScript(ESPmode == 0 ? STATION_SCRIPT : AP_SCRIPT);
+  enableTimer();
+}
+
+bool ESP8266::isBusy() {
+#if ESP_AP
+  if (ESPmode == 1) {
+    for (int i = 0; i < APLINKS; i++) {
+      if (clients[i].state != CLIENT_IDLE) {
+        return true;
+      }
     }
+    return false;
   }
-  enableTimer();
+#endif
+#if ESP_STATION
+  return requestHead != requestTail;
+#else
+  return false;
+#endif
 }
 
+#if ESP_STATION
 bool ESP8266::isConnected() {
   return connected;
 }
@@ -162,138 +334,437 @@ void ESP8266::connectWifi(String id, String pass) {
   }
   if (idOk && passOk) {
     newNetworkInfo = true;
+    wakeTick();
   }
 }
 
-bool ESP8266::isBusy() {
-  return hasRequest;
+bool ESP8266::sendRequest(int type, String domain, int port, String path, String data) {
+  return sendRequest(type, domain, port, path, data, false);
 }
 
-void ESP8266::sendRequest(int type, String domain, int port, String path, String data) {
-  sendRequest(type, domain, port, path, data, false);
+bool ESP8266::sendRequest(int type, String domain, int port, String path, String data, bool auto_retry) {
+  return sendRequest(type, domain.c_str(), port, path.c_str(), data.c_str(),
+      auto_retry);
 }
 
-void ESP8266::sendRequest(int type, String domain, int port, String path, String data, bool auto_retry) {
-  RequestType _type;
-  if (type == GET) {
-    _type = GET_REQ;
-  } else if (type == POST) {
-    _type = POST_REQ;
-  } else {
-    Serial.println("Error: Request type must be GET or POST");
-    return;
+// Queues a request without touching the heap, so this is also safe to call
+// from other interrupt handlers.  Returns false if the request was rejected,
+// which includes the request queue being full.
+bool ESP8266::sendRequest(int type, const char *domain, int port, const char *path, const char *data, bool auto_retry) {
+  return sendRequest(type, domain, strlen(domain), port, path, strlen(path),
+      data, strlen(data), auto_retry);
+}
+
+// As above, for callers that already know their lengths; the strings need not
+// be null terminated.  The data is copied, so the buffers are free on return.
+bool ESP8266::sendRequest(int type, const char *domain, size_t domainLen, int port, const char *path, size_t pathLen, const char *data, size_t dataLen, bool auto_retry) {
+  if (dataLen > DATASIZE - 1 || requestLength(type == POST ? POST_REQ : GET_REQ,
+      domainLen, port, pathLen, dataLen) > CIPSEND_MAX) {
+    if (serialYes) {
+      Serial.println("Domain or path or data is too long");
+    }
+    return false;
   }
-  if (domain.length() > DOMAINSIZE - 1 ||
-      path.length() > PATHSIZE - 1 ||
-      data.length() > DATASIZE - 1) {
-    Serial.println("Domain or path or data is too long");
-  } else if (!hasRequest) { // Only send request if one isn't pending already
-    disableTimer();
-    domain.toCharArray((char *)request_p->domain, DOMAINSIZE);
-    path.toCharArray((char *)request_p->path, PATHSIZE);
-    data.toCharArray((char *)request_p->data, DATASIZE);
-    request_p->port = port;
-    request_p->type = _type;
-    request_p->auto_retry = auto_retry;
-    request_p->ssl = false;
-    request_p->data_ref = NULL;
-    request_p->data_offset = 0;
-    request_p->big = false;
-    hasRequest = true;
-    responseReady = false;
-    enableTimer();
-    //benchmark = millis();
-  } else if (serialYes) {
-    Serial.println("Could not make request; one is already in progress");
-  }
-}
-
-void ESP8266::sendBigRequest(String domain, int port, String path, const char* data) {
-  RequestType _type = POST_REQ;
-  if (domain.length() > DOMAINSIZE - 1 ||
-      path.length() > PATHSIZE - 1) {
-    Serial.println("Domain or path is too long");
-  } else if (!hasRequest) { // Only send request if one isn't pending already
-    disableTimer();
-    domain.toCharArray((char *)request_p->domain, DOMAINSIZE);
-    path.toCharArray((char *)request_p->path, PATHSIZE);
-    request_p->port = port;
-    request_p->type = _type;
-    request_p->ssl = port == 443;
-    request_p->auto_retry = false;
-    request_p->data_ref = (volatile char*) data;
-    request_p->data_offset = 0;
-    request_p->data_len = strlen(data);
-    request_p->big = true;
-    hasRequest = true;
-    responseReady = false;
-    enableTimer();
-    //benchmark = millis();
-  } else if (serialYes) {
-    Serial.println("Could not make request; one is already in progress");
+  volatile Request *r = openRequest(type, domain, domainLen, port, path,
+      pathLen, auto_retry);
+  if (r == NULL) {
+    return false;
+  }
+  memcpy((char *)r->data, data, dataLen);
+  r->data[dataLen] = '\0';
+  publishRequest(r);
+  return true;
+}
+
+#if ESP_UPLOADS
+bool ESP8266::sendBigRequest(String domain, int port, String path, const char* data) {
+  return sendBigRequest(domain.c_str(), port, path.c_str(), data, strlen(data));
+}
+
+// Sends dataLen bytes of data as a chunked POST.  The data is not copied: it
+// is read from the caller's buffer as the chunks go out, so it must be left
+// alone until the response arrives (or isBusy() returns false).
+bool ESP8266::sendBigRequest(const char *domain, int port, const char *path, const char *data, size_t dataLen) {
+  volatile Request *r = openUpload(domain, port, path);
+  if (r == NULL) {
+    return false;
+  }
+  r->data_ref = (volatile char*) data;
+  r->data_len = dataLen;
+  r->big = true;
+  publishRequest(r);
+  return true;
+}
+
+// Sends a chunked JSON POST whose body comes from source, which the ISR calls
+// for more as the chunks go out.  source(buf, len) copies up to len bytes
+// into buf and returns how many, or 0 at the end of the body.  It runs in
+// the ISR, so it must return right away and can't use String.
+bool ESP8266::sendUploadRequest(const char *domain, int port, const char *path, UploadSource source) {
+  volatile Request *r = openUpload(domain, port, path);
+  if (r == NULL) {
+    return false;
+  }
+  r->source = source;
+  r->big = true;
+  publishRequest(r);
+  return true;
+}
+
+// openRequest() for an upload, whose head buildUpload() puts in data.
+// Returns NULL if the head wouldn't fit there.
+volatile ESP8266::Request *ESP8266::openUpload(const char *domain, int port, const char *path) {
+  size_t domainLen = strlen(domain);
+  size_t pathLen = strlen(path);
+  if (HTTP_UPLOAD_FIXED_LEN + domainLen + numDigits(port, 10) + pathLen
+      > DATASIZE) {
+    if (serialYes) {
+      Serial.println("Domain or path is too long for an upload");
+    }
+    return NULL;
+  }
+  volatile Request *r = openRequest(POST, domain, domainLen, port, path,
+      pathLen, false);
+  if (r != NULL) {
+    r->ssl = port == 443;
+  }
+  return r;
+}
+#endif
+
+#if ESP_STREAMING
+// Sends a request whose response body is streamed rather than stored:
+// read it with readStream() as it arrives, so it can be any size.  Only one
+// streamed request can be in progress at a time, and it isn't auto retried.
+// Its status still arrives through hasResponse(), with an empty body.
+bool ESP8266::sendStreamRequest(int type, const char *domain, int port, const char *path, const char *data) {
+  size_t dataLen = strlen(data);
+  if (streamActive) {
+    if (serialYes) {
+      Serial.println("Error: A streamed request is already in progress");
+    }
+    return false;
+  }
+  if (dataLen > DATASIZE - 1 || requestLength(type == POST ? POST_REQ : GET_REQ,
+      strlen(domain), port, strlen(path), dataLen) > CIPSEND_MAX) {
+    if (serialYes) {
+      Serial.println("Domain or path or data is too long");
+    }
+    return false;
+  }
+  streamHead = 0;
+  streamTail = 0;
+  streamEnded = false;
+  streamFailed = false;
+  volatile Request *r = openRequest(type, domain, strlen(domain), port, path,
+      strlen(path), false);
+  if (r == NULL) {
+    return false;
+  }
+  streamActive = true;
+  memcpy((char *)r->data, data, dataLen + 1);
+  r->stream = true;
+  publishRequest(r);
+  return true;
+}
+
+// Copies up to len bytes of the streamed response body into buf and returns
+// how many.  Returns 0 if none have arrived yet, and -1 once the response is
+// over and all of it has been read, which also frees the stream for another
+// request.  Call it often: bytes that don't fit in STREAMSIZE are lost.
+int ESP8266::readStream(char *buf, int len) {
+  bool ended = streamEnded;
+  ESP_BARRIER();
+  uint16_t head = streamHead;
+  uint16_t tail = streamTail;
+  int n = 0;
+  while (n < len && tail != head) {
+    buf[n++] = streamBuffer[tail & (STREAMSIZE-1)];
+    tail++;
+  }
+  ESP_BARRIER();
+  streamTail = tail; // Hand the space back to the ISR
+  if (n == 0 && ended && streamActive) {
+    streamActive = false;
+    return -1;
+  }
+  return n;
+}
+
+// Number of streamed body bytes waiting to be read
+int ESP8266::streamAvailable() {
+  return (uint16_t)(streamHead - streamTail);
+}
+
+// False if the streamed request failed, or bytes were lost because the
+// stream wasn't read in time
+bool ESP8266::isStreamOk() {
+  return !streamFailed;
+}
+#endif
+
+// Starts building a request in place, in the request slot itself: add the
+// query string (GET) or form body (POST) with addParam() and appendData(),
+// then queue it with submitRequest() or drop it with abortRequest().  One
+// request can be built at a time, and requests queued behind it wait until it
+// is submitted, so build from one context and don't hold the slot for long.
+bool ESP8266::beginRequest(int type, const char *domain, int port, const char *path, bool auto_retry) {
+  if (building != NULL) {
+    if (serialYes) {
+      Serial.println("Error: A request is already being built");
+    }
+    return false;
+  }
+  building = openRequest(type, domain, strlen(domain), port, path,
+      strlen(path), auto_retry);
+  buildLen = 0;
+  buildFailed = false;
+  return building != NULL;
+}
+
+// Appends key=value, separated from the previous pair by '&', with both
+// percent-encoded.  Returns false if it doesn't fit in DATASIZE, in which
+// case submitRequest() will drop the request.
+bool ESP8266::addParam(const char *key, const char *value) {
+  if (building == NULL || buildFailed) {
+    return false;
+  }
+  int start = buildLen;
+  if ((buildLen == 0 || buildChar('&')) && buildEncoded(key)
+      && buildChar('=') && buildEncoded(value)) {
+    return true;
+  }
+  buildLen = start;
+  building->data[buildLen] = '\0';
+  buildFailed = true;
+  return false;
+}
+
+bool ESP8266::addParam(const char *key, long value) {
+  char digits[12];
+  sprintf(digits, "%ld", value);
+  return addParam(key, digits);
+}
+
+// Appends len bytes of data as they are, for bodies addParam() can't express
+bool ESP8266::appendData(const char *data, size_t len) {
+  if (building == NULL || buildFailed) {
+    return false;
   }
+  if (buildLen + len > DATASIZE - 1) {
+    buildFailed = true;
+    return false;
+  }
+  memcpy((char *)building->data + buildLen, data, len);
+  buildLen += len;
+  building->data[buildLen] = '\0';
+  return true;
+}
+
+// Queues the request being built.  Returns false if there isn't one, or if
+// part of it didn't fit (the request is dropped).
+bool ESP8266::submitRequest() {
+  if (building == NULL) {
+    return false;
+  }
+  volatile Request *r = building;
+  if (buildFailed || requestLength(r->type, strlen((char *)r->domain), r->port,
+      strlen((char *)r->path), buildLen) > CIPSEND_MAX) {
+    if (serialYes) {
+      Serial.println("Domain or path or data is too long");
+    }
+    abortRequest();
+    return false;
+  }
+  building = NULL;
+  publishRequest(r);
+  return true;
+}
+
+// Gives up the request being built.  Its slot is handed to the ISR already
+// finished, so the ISR skips it.
+void ESP8266::abortRequest() {
+  if (building == NULL) {
+    return;
+  }
+  volatile Request *r = building;
+  building = NULL;
+  r->done = true;
+  ESP_BARRIER();
+  r->ready = true;
 }
 
+// The ISR drops everything submitted so far and stops retrying the request
+// in flight, which is left to finish on its own
 void ESP8266::clearRequest() {
-  disableTimer();
-  if (serialYes && hasRequest) {
+  if (serialYes && isBusy()) {
     Serial.println("Cleared in-progress request");
   }
-  hasRequest = false;
-  enableTimer();
+  cancelHead = requestHead;
+  ESP_BARRIER();
+  cancelRequested = true;
+  wakeTick();
 }
 
 bool ESP8266::hasResponse() {
-  return responseReady;
+  return responseHead != responseTail;
 }
+#endif
 
+#if ESP_AP
 bool ESP8266::hasData() {
-  return dataReady;
+  return heldHead != heldTail;
 }
 
 String ESP8266::getData() {
-  if(!hasRequest){
-    disableTimer();
-    if(ESPmode == 1){
-      String d = "";
-      d = ((char *)requestAP_p->data);
-      requestAP_p->data[0] = '\0';
-      hasRequest = true;
-      dataReady = false;
-      enableTimer();
-      return d;
-    }
-    else{
-      if(serialYes){
-        Serial.println("getData() is not supported in client mode.");
+  if(ESPmode == 1){
+    String d = "";
+    APRequest request;
+    if(getRequest(&request)){
+      if (request.query.len > 0) {
+        d = "?";
+        d += request.query.text;
       }
-      enableTimer();
-      return "\0";
+      releaseRequest();
     }
+    return d;
   }
   else{
-    return"\0";
+    if(serialYes){
+      Serial.println("getData() is not supported in client mode.");
+    }
+    return "\0";
+  }
+}
+
+// Points request's fields at the oldest request a client made that hasn't
+// been released, which stays put until releaseRequest() (or getData()) is
+// called.  Returns false if there's none.
+bool ESP8266::getRequest(APRequest *request) {
+  uint8_t tail = heldTail;
+  if (heldHead == tail) {
+    return false;
+  }
+  ESP_BARRIER();
+  const char *text = heldRequests[tail & (APHELDREQUESTS-1)];
+  RequestSpans *f = &heldFields[tail & (APHELDREQUESTS-1)];
+  RequestField *out[] = {&request->method, &request->path, &request->query,
+    &request->host, &request->contentType, &request->body};
+  Span spans[] = {f->method, f->path, f->query, f->host, f->contentType,
+    f->body};
+  for (int i = 0; i < 6; i++) {
+    out[i]->text = spanText(text, spans[i]);
+    out[i]->len = spans[i].len;
+  }
+  request->contentLength = f->contentLength;
+  request->truncated = f->truncated;
+  return true;
+}
+
+// Gives the request from getRequest() back, making room for another one
+void ESP8266::releaseRequest() {
+  if (heldHead == heldTail) {
+    return;
   }
+  ESP_BARRIER();
+  heldTail++;
 }
+#endif
 
+#if ESP_STATION
 String ESP8266::getResponse() {
-  disableTimer();
   String r = "";
-  if (responseReady) {
-    //benchmark = millis() - benchmark;
-    //Serial.println(benchmark);
-    r = ((char *)response);
-    response[0] = '\0';
-    responseReady = false; // after getting response, hasResponse() is false
-  } else if (serialYes) {
+  uint8_t tail = responseTail;
+  while (tail != responseHead) {
+    int slot = completionQueue[tail & (RESPONSEQUEUESIZE-1)];
+    readingSlot = slot;
+    ESP_BARRIER();
+    if (responseTail == tail) { // The ISR won't drop this slot now
+      //benchmark = millis() - benchmark;
+      //Serial.println(benchmark);
+      r = ((char *)response[slot]);
+      lastStatus = responseStatus[slot];
+#if ESP_TIMING
+      lastTiming = responseTiming[slot];
+#endif
+      ESP_BARRIER();
+      responseTail = tail + 1;
+      slotFree[slot] = true; // Hand the slot back to the ISR
+      readingSlot = -1;
+      return r;
+    }
+    tail = responseTail; // The ISR dropped it first, try the next one
+  }
+  readingSlot = -1;
+  if (serialYes) {
     Serial.println("No response ready");
   }
-  enableTimer();
   return r;
 }
 
+// HTTP status code of the response getResponse() returned last, or 0 if the
+// server didn't answer with HTTP
+int ESP8266::getResponseStatus() {
+  return lastStatus;
+}
+
+#if ESP_TIMING
+// When the request behind the response getResponse() returned last reached
+// each step
+ESP8266::RequestTiming ESP8266::getResponseTiming() {
+  return lastTiming;
+}
+
+// Summarizes the phases of every request completed so far.  Each phase is
+// copied again if the ISR updated it part way through.  p99 comes from the
+// phase's histogram, so it's the top of the bucket the 99th percentile
+// fell in.
+void ESP8266::getTimingStats(TimingStats *stats) {
+  for (int i = 0; i < NUMBEROFPHASES; i++) {
+    PhaseTotals p;
+    uint32_t seq;
+    do {
+      seq = timingSeq;
+      ESP_BARRIER();
+      memcpy(&p, &phaseTotals[i], sizeof(p));
+      ESP_BARRIER();
+    } while (seq != timingSeq);
+    PhaseStats *out = &stats->phases[i];
+    out->count = p.count;
+    out->minMicros = p.min;
+    out->maxMicros = p.max;
+    out->avgMicros = p.count > 0 ? p.total / p.count : 0;
+    uint32_t n = 0;
+    for (int b = 0; b < TIMINGBUCKETS; b++) {
+      n += p.buckets[b];
+    }
+    uint32_t rank = n - n / 100; // Values at or below the 99th percentile
+    uint32_t seen = 0;
+    out->p99Micros = 0;
+    for (int b = 0; b < TIMINGBUCKETS && n > 0; b++) {
+      seen += p.buckets[b];
+      if (seen >= rank) {
+        uint32_t top = b;
+        if (b >= 2) {
+          uint32_t step = 1UL << (b/2 - 1);
+          top = (1UL << (b/2)) + (b & 1) * step + step - 1;
+        }
+        out->p99Micros = top < p.max ? top : p.max;
+        break;
+      }
+    }
+  }
+}
+
+// Zeroes the phase totals, from the next run of the timer interrupt
+void ESP8266::resetTimingStats() {
+  timingClear = true;
+}
+#endif
+#endif
+
 String ESP8266::getMAC() {
-  return MAC;
+  return (char *)MAC;
 }
 
 String ESP8266::getVersion() {
@@ -304,6 +775,14 @@ String ESP8266::getStatus() {
   switch (state) {
     case IDLE:
     case CIPSTATUS:
+    case CIPCLOSE:
+#if ESP_STATION
+      for (int i = 0; i < STATIONLINKS; i++) {
+        if (links[i].state == AWAITRESPONSE) {
+          return "Waiting for server response";
+        }
+      }
+#endif
       return "Idle";
       break;
     case CWJAP:
@@ -312,6 +791,9 @@ String ESP8266::getStatus() {
     case CIPSTART:
     case CIPSEND:
     case DATAOUT:
+#if ESP_UPLOADS
+    case CHUNKOUT:
+#endif
       return "Sending to server";
     case AWAITRESPONSE:
       return "Waiting for server response";
@@ -319,49 +801,23 @@ String ESP8266::getStatus() {
   return "Status Unknown";
 }
 
+// Restores factory settings, then sets the modem up again.  Like reset(),
+// this only queues the work for the ISR.
 bool ESP8266::restore() {
-  disableTimer();
-  bool ok = true;
-  emptyRx();
-  wifiSerial.println(AT_RESTORE);
-  ok = ok && waitForTarget(READY, RESTORE_TIMEOUT);
-  ok = ok && reset();
-  enableTimer();
-  return ok;
+  startupOk = true;
+  requestScript(RESTORE_SCRIPT);
+  return reset();
 }
 
+#if ESP_AP
 bool ESP8266::startAP(){
-  disableTimer();
-  bool ok = true;
-  emptyRx();
-  wifiSerial.println(AT_CWMODE_AP);
-  ok = ok && waitForTarget(OK, CWMODE_TIMEOUT);
-  if (serialYes) {
-    if (ok) {
-      Serial.println("CW_MODE: 2");
-    } else {
-      Serial.println("CW_MODE SET ERROR");
-    }
-    Serial.flush();
-  }
-  emptyRx();
-  wifiSerial.println(AT_RST);
-  ok = ok && waitForTarget(OK, RST_TIMEOUT);
-  if (serialYes) {
-    if (ok) {
-      Serial.println("Reset successful");
-    } else {
-      Serial.println("WARNING: Reset unsuccesful");
-    }
-    Serial.flush();
-  }
-  enableTimer();
-  return ok;
+  requestScript(AP_SCRIPT);
+  return true;
 }
 
+// Queues the server setup for the ISR.  Returns false if the network name or
+// password was rejected; isStartupOk() tells whether the server started.
 bool ESP8266::startserver(String netName, String pass){
-  disableTimer();
-  delay(500);
   if (netName == "") {
     if (serialYes) {
       Serial.println("The empty string is not a valid SSID");
@@ -378,183 +834,204 @@ bool ESP8266::startserver(String netName, String pass){
       Serial.println("Given password is too long");
     }
   }
-  if (idOk && passOk) {
-    newNetworkInfo = true;
-  }
-  bool ok = true;
-  emptyRx();
-    wifiSerial.print(AT_CWSAP_SET);
-    String s = (char *)ssid;
-    String p = (char *)password;
-  wifiSerial.println('\"' + s + '\"' + ',' + '\"' + p + '\"' + ',' + "1" + ',' + "4");
-  ok = ok && waitForTarget(OK, CWSAP_TIMEOUT);
-  emptyRx();
-  wifiSerial.println(AT_CIPMUX);
-  ok = ok && waitForTarget(OK, CIPMUX_TIMEOUT);
-  emptyRx();
-  wifiSerial.println(AT_CIPSERVER);
-  ok = ok && waitForTarget(OK, CIPSERVER_TIMEOUT);
-  emptyRx();
-  wifiSerial.println(AT_CIPAP_SET);
-  ok = ok && waitForTarget(OK, CIPAP_TIMEOUT);
-  if (serialYes) {
-    if (ok) {
-      Serial.println("Server Started");
-      serverStatus = true;
-    } else {
-      Serial.println("ERROR Starting Server");
-    }
-    Serial.flush();
+  if (!idOk || !passOk) {
+    return false;
   }
-  enableTimer();
-  return ok;
+  newNetworkInfo = true;
+  startupOk = true;
+  requestScript(SERVER_SCRIPT);
+  return true;
 }
 
-bool ESP8266::setServer(){
-  delay(500);
-  bool ok = true;
-  emptyRx();
-    wifiSerial.print(AT_CWSAP_SET);
-    String s = (char *)ssid;
-    String p = (char *)password;
-  wifiSerial.println('\"' + s + '\"' + ',' + '\"' + p + '\"' + ',' + "1" + ',' + "4");
-  ok = ok && waitForTarget(OK, CWSAP_TIMEOUT);
-  emptyRx();
-  wifiSerial.println(AT_CIPMUX);
-  ok = ok && waitForTarget(OK, CIPMUX_TIMEOUT);
-  emptyRx();
-  wifiSerial.println(AT_CIPSERVER);
-  ok = ok && waitForTarget(OK, CIPSERVER_TIMEOUT);
-  emptyRx();
-  wifiSerial.println(AT_CIPAP_SET);
-  ok = ok && waitForTarget(OK, CIPAP_TIMEOUT);
-  if (serialYes) {
-    if (ok) {
-      Serial.println("Server Started");
-      serverStatus = true;
-    } else {
-      Serial.println("ERROR Starting Server");
+// The ISR holds off serving while pagesBusy is set, so the timer keeps running
+void ESP8266::setPage(String directory, String html){
+  pagesBusy = true;
+  ESP_BARRIER();
+  if (directory.length() > PAGESIZE - 1){
+    if(serialYes){
+      Serial.println();
+      Serial.print("Directory name too long.");
+    }
+  }
+  else if (storePage(directory.c_str(), directory.length(), html.c_str(),
+      html.length(), true, NULL)){
+    if(serialYes){
+      Serial.println();
+      Serial.println("Page set.");
+    }
+  }
+  else{
+    if(serialYes){
+      Serial.println();
+      Serial.println("No more pages can be set");
     }
-    Serial.flush();
   }
-  return ok;
+  ESP_BARRIER();
+  pagesBusy = false;
 }
 
-void ESP8266::setPage(String directory, String html){
-  if(hasRequest){
-    disableTimer();
-    if (directory.length() > PAGESIZE){
-      if(serialYes){
-        Serial.println();
-        Serial.print("Directory name too long.");
-      }
-    }
-    else if (pageExists(directory)){
-      pageStore(storedPages->directory, directory, html);
-      if(serialYes){
-        Serial.println();
-        Serial.println("Page set.");
-      }
+// Like setPage(), but the page's html is made by handler each time it's
+// requested, rather than stored
+void ESP8266::setPageHandler(String directory, PageHandler handler){
+  pagesBusy = true;
+  ESP_BARRIER();
+  if (directory.length() > PAGESIZE - 1){
+    if(serialYes){
+      Serial.println();
+      Serial.print("Directory name too long.");
     }
-    else if(pagesAvailable()){
-      pageCreate(storedPages->directory,directory);
-      pageStore(storedPages->directory, directory, html);
-      if(serialYes){
-        Serial.println();
-        Serial.print("Page created.");
-      }
+  }
+  else if (storePage(directory.c_str(), directory.length(), NULL, 0, true,
+      handler)){
+    if(serialYes){
+      Serial.println();
+      Serial.println("Page handler set.");
     }
-    else{
-      if(serialYes){
-        Serial.println();
-        Serial.println("No more pages can be set");
-      }
+  }
+  else{
+    if(serialYes){
+      Serial.println();
+      Serial.println("No more pages can be set");
     }
-    enableTimer();
   }
+  ESP_BARRIER();
+  pagesBusy = false;
 }
 
-//creates the page
-void ESP8266::pageCreate(volatile char arr[], String directory){
-  for(int i = 0; i < NUMBEROFPAGES; i++){
-    String cmp = arr[i*PAGESIZE];
-    if(cmp == "\0"){
-      for(unsigned int c = 0;c < directory.length()+1;c++){
-        arr[i*PAGESIZE + c] = directory[c];
+// Adds a page, or replaces the page with that path.  The complete HTTP
+// response is rendered here, with a 404 status unless found, so serving it
+// is a single write.  With a handler only the head is stored, without a
+// length, and the html follows it as the handler makes it.  A replaced
+// page is cut out of the arena, which is compacted, and stored again at
+// the end.  Returns false if there's no route or arena space left for it.
+bool ESP8266::storePage(const char *path, size_t pathLen, const char *html, size_t htmlLen, bool found, PageHandler handler){
+  volatile Pages *p = storedPages;
+  char *arena = (char *)p->arena;
+  char head[HTTP_PAGE_HEADSIZE];
+  size_t headLen;
+  if (handler != NULL){
+    htmlLen = 0;
+    headLen = snprintf(head, sizeof(head), "%s%s\r\n", HTTP_PAGE_OK,
+        HTTP_PAGE_TYPE);
+  }
+  else{
+    headLen = snprintf(head, sizeof(head), "%s%s%u%s",
+        found ? HTTP_PAGE_OK : HTTP_PAGE_NOT_FOUND, HTTP_PAGE_HEAD,
+        (unsigned)htmlLen, HTTP_END);
+  }
+  size_t responseLen = headLen + htmlLen;
+  int r = findRoute(path, pathLen);
+  size_t freed = r >= 0 ? p->routes[r].pathLen + p->routes[r].responseLen : 0;
+  if (p->used - freed + pathLen + responseLen > PAGESTORAGE
+      || (r < 0 && p->count >= NUMBEROFPAGES)){
+    return false;
+  }
+  if (r >= 0){
+    uint16_t start = p->routes[r].offset;
+    memmove(arena + start, arena + start + freed, p->used - start - freed);
+    p->used -= freed;
+    for(int i = 0; i < p->count; i++){
+      if (p->routes[i].offset > start){
+        p->routes[i].offset -= freed;
       }
-      break;
     }
   }
-
+  else{
+    r = p->count++;
+    p->routes[r].hash = hashPath(path, pathLen);
+    p->routes[r].pathLen = pathLen;
+    p->routes[r].version = 0;
+    uint32_t slot = p->routes[r].hash;
+    while (p->index[slot & (ROUTEINDEXSIZE-1)] != 0){
+      slot++;
+    }
+    p->index[slot & (ROUTEINDEXSIZE-1)] = r + 1;
+  }
+  p->routes[r].offset = p->used;
+  p->routes[r].responseLen = responseLen;
+  p->routes[r].handler = handler;
+  p->routes[r].version++;
+  memcpy(arena + p->used, path, pathLen);
+  memcpy(arena + p->used + pathLen, head, headLen);
+  if (htmlLen > 0) { // A handler page has no html, and html may be NULL
+    memcpy(arena + p->used + pathLen + headLen, html, htmlLen);
+  }
+  p->used += pathLen + responseLen;
+  return true;
 }
+#endif
 
-//stores the html with the coresponding directory
-void ESP8266::pageStore(volatile char arr[], String dir, String html){
-  for(int i = 0; i < NUMBEROFPAGES; i++){
-    String cmp = arr[i*PAGESIZE];
-    if(cmp == dir){
-      for(unsigned int c = 0;c < html.length()+1;c++){
-        storedPages->html[i*HTMLSTORAGE+c] = html[c];
-      }
+// Queues a modem reset for the ISR, which runs it once the command in
+// progress is done.  Requests in flight are started again afterwards.
+bool ESP8266::reset() {
+  startupOk = true;
+  if (ESPmode == 0) {
+    requestScript(RESET_SCRIPT);
+  } else {
+    requestScript(AP_SCRIPT);
+    if (serverStatus) {
+      requestScript(SERVER_SCRIPT);
     }
   }
+  return true;
 }
 
-//checks if a page exists
-bool ESP8266::pageExists(String directory){
-  for(int i = 0; i < NUMBEROFPAGES; i++){
-    String cmp = (char *)(storedPages->directory+i*PAGESIZE);
-    if(cmp == directory){
-      return true;
-    }
+// True while a startup, reset, restore or server script is queued or running
+bool ESP8266::isStarting() {
+  return scriptsPending != 0 || scriptRunning >= 0;
+}
+
+// False if a step of the scripts run since begin() (or the last reset(),
+// restore() or startserver()) failed
+bool ESP8266::isStartupOk() {
+  return startupOk;
+}
+
+// Percentage of the running script's steps done, 100 when none is running
+int ESP8266::getStartupProgress() {
+  int running = scriptRunning;
+  if (running < 0) {
+    return scriptsPending != 0 ? 0 : 100;
   }
-  if(serialYes){
-    Serial.println();
-    Serial.println("Page does not Exist.");
+  int steps = 0;
+  while (SCRIPTS[running][steps].command != NULL) {
+    steps++;
   }
-  return false;
+  return scriptStep*100/steps;
 }
 
-//checks if more pages can be stored
-bool ESP8266::pagesAvailable(){
-  for(int i = 0; i < NUMBEROFPAGES; i++){
-    String cmp = (char *)(storedPages->directory+i*PAGESIZE);
-    if(cmp == "\0"){
-      return true;
-    }
+// Reports the driver's RAM use.  Everything but the ISR's stack is part of
+// the ESP8266 object, so sizes only change with the build configuration.
+ESP8266::MemoryReport ESP8266::memoryReport() {
+  MemoryReport m;
+  m.total = sizeof(*this);
+  m.inputBuffer = sizeof(inputBuffer);
+  m.modeStorage = sizeof(storage);
+  m.requests = 0;
+  m.responses = 0;
+  m.pages = 0;
+  m.stream = 0;
+#if ESP_STATION
+  if (ESPmode == 0) {
+    m.requests = sizeof(storage.station.requests);
+    m.responses = sizeof(storage.station.response);
+#if ESP_STREAMING
+    m.stream = sizeof(storage.station.stream);
+#endif
   }
-  if(serialYes){
-    Serial.println();
-    Serial.println("Page array is full.");
+#endif
+#if ESP_AP
+  if (ESPmode == 1) {
+    m.requests = sizeof(storage.ap.requests);
+    m.pages = sizeof(storage.ap.pages);
   }
-  return false;
+#endif
+  m.heapBlocks = 0; // Mode storage is part of the object, nothing is malloc'd
+  m.isrStackPeak = isrStackPeak;
+  return m;
 }
 
-bool ESP8266::reset() {
-  disableTimer();
-  bool ok = true;
-  emptyRx();
-  wifiSerial.println(AT_CWAUTOCONN);
-  ok = ok && waitForTarget(OK, CWAUTOCONN_TIMEOUT);
-  emptyRx();
-  wifiSerial.println(AT_CWMODE);
-  ok = ok && waitForTarget(OK, CWMODE_TIMEOUT);
-  emptyRx();
-  wifiSerial.println(AT_RST);
-  ok = ok && waitForTarget(READY, RST_TIMEOUT);
-  if (serialYes) {
-    if (ok) {
-      Serial.println("Reset successful");
-    } else {
-      Serial.println("WARNING: Reset unsuccesful");
-    }
-    Serial.flush();
-  }
-  enableTimer();
-  return ok;
-}
-
-String ESP8266::sendCustomCommand(String command, unsigned long timeout) {
+String ESP8266::sendCustomCommand(String command, unsigned long timeout) {
   disableTimer();
   emptyRx();
   wifiSerial.println(command);
@@ -570,6 +1047,7 @@ String ESP8266::sendCustomCommand(String command, unsigned long timeout) {
   return customResponse;
 }
 
+#if ESP_STATION
 bool ESP8266::isAutoConn() {
   return doAutoConn;
 }
@@ -578,6 +1056,91 @@ void ESP8266::setAutoConn(bool value) {
   doAutoConn = value;
 }
 
+bool ESP8266::isKeepAlive() {
+  return keepAlive;
+}
+
+void ESP8266::setKeepAlive(bool value) {
+  keepAlive = value;
+}
+
+void ESP8266::setKeepAlive(bool value, unsigned long idleTimeout) {
+  keepAliveTimeout = idleTimeout;
+  keepAlive = value;
+}
+#endif
+
+bool ESP8266::isAdaptiveTick() {
+  return adaptiveTick;
+}
+
+// With value true, the timer interrupt slows down while the driver is idle
+// or waiting on the modem, up to TICK_IDLE_MICROS between ticks, and speeds
+// back up as soon as anything arrives or is submitted
+void ESP8266::setAdaptiveTick(bool value) {
+  adaptiveTick = value;
+  wakeTick();
+}
+
+unsigned long ESP8266::getTickMicros() {
+  return tickMicros;
+}
+
+#if ESP_PROFILE
+// Copies the ISR profile.  The copy is taken again if an ISR run updated
+// it part way through, so it's consistent without turning interrupts off.
+void ESP8266::getProfile(Profile *profile) {
+  uint32_t seq;
+  do {
+    seq = profileSeq;
+    ESP_BARRIER();
+    memcpy(profile, &profileData, sizeof(Profile));
+    ESP_BARRIER();
+  } while (seq != profileSeq);
+}
+
+// Zeroes the profile at the next ISR run
+void ESP8266::resetProfile() {
+  profileClear = true;
+}
+#endif
+
+#if ESP_METRICS
+// Copies the failure counters, the same way as getProfile()
+void ESP8266::getMetrics(Metrics *metrics) {
+  uint32_t seq;
+  do {
+    seq = metricsSeq;
+    ESP_BARRIER();
+    memcpy(metrics, &metricsData, sizeof(Metrics));
+    ESP_BARRIER();
+  } while (seq != metricsSeq);
+  if (metricsClear) { // The ISR hasn't got round to it yet
+    memset(metrics, 0, sizeof(Metrics));
+  }
+}
+
+// Zeroes the counters at the next ISR run
+void ESP8266::resetMetrics() {
+  metricsClear = true;
+}
+#endif
+
+// Name of a per-state row (of the profile or metrics) in the current mode,
+// or NULL if the row isn't used
+const char *ESP8266::getStateName(int row) {
+  if (row == STATEROWS - 1) {
+    return "Scripts";
+  }
+  const char * const *names = ESPmode == 0 ? STATE_NAMES : STATE_AP_NAMES;
+  for (int i = 0; i <= row; i++) {
+    if (names[i] == NULL) {
+      return NULL;
+    }
+  }
+  return row >= 0 ? names[row] : NULL;
+}
+
 int ESP8266::getTransmitCount() {
   return transmitCount;
 }
@@ -595,66 +1158,46 @@ void ESP8266::resetReceiveCount() {
 }
 
 //// PRIVATE FUNCTIONS (Non-ISR only)
+// With ESP_EXTERNAL_TICK there's no timer; the sketch calls tick() instead
 void ESP8266::enableTimer() {
+  quietTicks = 0;
+  tickMicros = ESPmode == 0 ? INTERRUPT_MICROS : INTERRUPT_MICROS_AP;
+#if !ESP_EXTERNAL_TICK
+#if ESP_STATION
   if (ESPmode == 0){
     timer.begin(ESP8266::handleInterrupt, INTERRUPT_MICROS);
   }
-  else if (ESPmode == 1){
+#endif
+#if ESP_AP
+  if (ESPmode == 1){
     timer.begin(ESP8266::handleInterruptAP, INTERRUPT_MICROS_AP);
   }
+#endif
+#endif
 }
 
 void ESP8266::disableTimer() {
+#if !ESP_EXTERNAL_TICK
   timer.end();
+#endif
 }
 
-// Check if ESP8266 is present, this
-bool ESP8266::checkPresent() {
-  emptyRx();
-  wifiSerial.println(AT_BASIC);
-  bool ok = waitForTarget(OK, AT_TIMEOUT);
-  if (serialYes) {
-    if (ok) {
-      Serial.println("ESP8266 present");
-    } else {
-      Serial.println("ESP8266 not present");
-    }
-    Serial.flush();
-  }
-  return ok;
-}
-
-// Blocking function (with timeout) to get MAC address of ESP8266
-void ESP8266::getMACFromDevice() {
-  MAC = "";
-  wifiSerial.println(AT_CIPAPMAC);  //Send MAC query
-  unsigned long start = millis();
-  bool foundMacStart = false;
-  while (millis() - start < MAC_TIMEOUT) {
-    if (wifiSerial.available() > 0) {
-      char c = wifiSerial.read();
-      if (serialYes) {
-        Serial.print(c);
-      }
-      if (foundMacStart) {
-        MAC = String(MAC+c);
-        if (MAC.length() >= MACSIZE) {
-          unsigned long timeLeft = MAC_TIMEOUT - millis() + start;
-          if (waitForTarget(OK,timeLeft)){ //Wait for rest of message
-            return; //MAC now holds the MAC address
-          } else {
-            break; // timeout before "OK" received
-          }
-        }
-      } else if (c == '"') {
-        foundMacStart = true;
-      }
-    }
+#if ESP_EXTERNAL_TICK
+// Runs what the timer interrupt would, once.  Call it about every
+// getTickMicros() microseconds, and never from two contexts at once.
+void ESP8266::tick() {
+#if ESP_STATION
+  if (ESPmode == 0){
+    handleInterrupt();
   }
-  if (serialYes) {
-    Serial.println("MAC address request timed out");
+#endif
+#if ESP_AP
+  if (ESPmode == 1){
+    handleInterruptAP();
   }
+#endif
 }
+#endif
 
 // Empty wifi serial buffer
 void ESP8266::emptyRx() {
@@ -663,31 +1206,6 @@ void ESP8266::emptyRx() {
   }
 }
 
-// Wait until target received over wifiSerial, or timeout as elapsed
-// Return whether target was received before the timeout
-bool ESP8266::waitForTarget(const char *target, unsigned long timeout) {
-  String resp = "";
-  unsigned long start = millis();
-  if (serialYes) {
-    Serial.println();
-    Serial.print("Waiting for ");
-    Serial.println(target);
-  }
-  while (millis() - start < timeout) {
-    if (wifiSerial.available() > 0) {
-      char c = wifiSerial.read();
-      resp = String(resp+c);
-      if (resp.endsWith(target)) {
-        if (serialYes) {
-          Serial.println(); // New line
-        }
-        return true;
-      }
-    }
-  }
-  return false;
-}
-
 
 bool ESP8266::stringToVolatileArray(String str, volatile char arr[], uint32_t len) {
   if (str.length() >= (len - 1)) { //string is too long
@@ -700,73 +1218,239 @@ bool ESP8266::stringToVolatileArray(String str, volatile char arr[], uint32_t le
   return true;
 }
 
-//// PRIVATE FUNCTIONS (ISR - no String class allowed)
-// Static handler calls singleton instance's handler
-void ESP8266::handleInterrupt(void) {
-    _instance->processInterrupt();
+//// PRIVATE FUNCTIONS (Any context)
+#if ESP_STATION
+// Reserves the next free request slot, or returns NULL if the queue is full.
+// The compare-and-swap keeps two producers (say, loop() and an interrupt
+// handler that preempts it) from reserving the same slot.
+volatile ESP8266::Request *ESP8266::claimRequest() {
+  uint8_t head = requestHead;
+  do {
+    if ((uint8_t)(head - requestTail) >= REQUESTQUEUESIZE) {
+      return NULL;
+    }
+  } while (!__atomic_compare_exchange_n((uint8_t *)&requestHead, &head,
+      (uint8_t)(head + 1), false, __ATOMIC_SEQ_CST, __ATOMIC_SEQ_CST));
+  return &requestQueue[head & (REQUESTQUEUESIZE-1)];
 }
 
-void ESP8266::handleInterruptAP(void) {
-    _instance->processInterruptAP();
+// Checks a request and reserves a slot for it with everything but the data
+// filled in.  Returns NULL if the request was rejected.
+volatile ESP8266::Request *ESP8266::openRequest(int type, const char *domain, size_t domainLen, int port, const char *path, size_t pathLen, bool auto_retry) {
+  RequestType _type;
+  if (type == GET) {
+    _type = GET_REQ;
+  } else if (type == POST) {
+    _type = POST_REQ;
+  } else {
+    if (serialYes) {
+      Serial.println("Error: Request type must be GET or POST");
+    }
+    return NULL;
+  }
+  if (domainLen > DOMAINSIZE - 1 || pathLen > PATHSIZE - 1) {
+    if (serialYes) {
+      Serial.println("Domain or path or data is too long");
+    }
+    return NULL;
+  }
+  volatile Request *r = claimRequest();
+  if (r == NULL) {
+    if (serialYes) {
+      Serial.println("Could not make request; request queue is full");
+    }
+    return NULL;
+  }
+  memcpy((char *)r->domain, domain, domainLen);
+  r->domain[domainLen] = '\0';
+  memcpy((char *)r->path, path, pathLen);
+  r->path[pathLen] = '\0';
+  r->data[0] = '\0';
+  r->port = port;
+  r->type = _type;
+  r->auto_retry = auto_retry;
+  r->ssl = false;
+#if ESP_UPLOADS
+  r->data_ref = NULL;
+  r->data_len = 0;
+  r->data_offset = 0;
+  r->source = NULL;
+  r->prepared = false;
+  r->source_done = false;
+  r->body_done = false;
+  r->body_sent = false;
+  r->big = false;
+#endif
+#if ESP_STREAMING
+  r->stream = false;
+#endif
+  r->done = false;
+#if ESP_TIMING
+  memset((void *)&r->timing, 0, sizeof(RequestTiming));
+#endif
+  return r;
+}
+#endif
+
+// Asks the ISR to run a startup script.  The ISR clears the bit when it
+// starts it, so this may be called from any context.
+void ESP8266::requestScript(Script script) {
+  __atomic_fetch_or((uint8_t *)&scriptsPending, (uint8_t)(1 << script),
+      __ATOMIC_SEQ_CST);
+  wakeTick();
+}
+
+// Brings a slowed down tick back to full speed.  The new period starts
+// after the tick in progress, so work waits at most TICK_IDLE_MICROS.
+void ESP8266::wakeTick() {
+  tickWake = true;
+  unsigned long fast = ESPmode == 0 ? INTERRUPT_MICROS : INTERRUPT_MICROS_AP;
+  if (tickMicros != fast) {
+    tickMicros = fast;
+#if !ESP_EXTERNAL_TICK
+    timer.update(fast);
+#endif
+  }
 }
 
+#if ESP_STATION
+// Hands a filled in slot to the ISR
+void ESP8266::publishRequest(volatile Request *r) {
+  ESP_BARRIER();
+#if ESP_TIMING
+  r->timing.queued = micros();
+#endif
+  r->ready = true;
+  wakeTick();
+  //benchmark = millis();
+}
+
+// Builder helpers: append to the request being built, false if it's full
+bool ESP8266::buildChar(char c) {
+  if (buildLen >= DATASIZE - 1) {
+    return false;
+  }
+  building->data[buildLen++] = c;
+  building->data[buildLen] = '\0';
+  return true;
+}
+
+// Percent-encodes everything but unreserved characters, as both query
+// strings and x-www-form-urlencoded bodies expect
+bool ESP8266::buildEncoded(const char *s) {
+  static const char HEX_DIGITS[] = "0123456789ABCDEF";
+  for (; *s != '\0'; s++) {
+    char c = *s;
+    if (isalnum((unsigned char)c) || c == '-' || c == '_' || c == '.'
+        || c == '~') {
+      if (!buildChar(c)) {
+        return false;
+      }
+    } else if (!buildChar('%') || !buildChar(HEX_DIGITS[(c >> 4) & 0xF])
+        || !buildChar(HEX_DIGITS[c & 0xF])) {
+      return false;
+    }
+  }
+  return true;
+}
+#endif
 
+//// PRIVATE FUNCTIONS (ISR - no String class allowed)
+#if ESP_STATION
+// Static handler calls singleton instance's handler
+void ESP8266::handleInterrupt(void) {
+#if ESP_PROFILE
+    _instance->profileBegin();
+#endif
+    _instance->isrStackBase = (uintptr_t)__builtin_frame_address(0);
+    uint32_t before = _instance->tickState();
+    _instance->processInterrupt();
+    _instance->adaptTick(before);
+    _instance->isrStackBase = 0;
+#if ESP_PROFILE
+    _instance->profileEnd();
+#endif
+}
 
-// Main interrupt handler, ISR activity follows an FSM pattern
+// Main interrupt handler, ISR activity follows an FSM pattern.  The AT
+// command channel is shared by all links, so state tracks the one command in
+// progress, on behalf of activeLink from CIPSTART through DATAOUT and in
+// CIPCLOSE.  Links waiting for a response are handled separately, in parallel.
 void ESP8266::processInterrupt() {
+  loadRx(); // Routes +IPD payloads to their links
+#if ESP_TIMING
+  if (timingClear) {
+    timingSeq++;
+    ESP_BARRIER();
+    memset(phaseTotals, 0, sizeof(phaseTotals));
+    timingClear = false;
+    ESP_BARRIER();
+    timingSeq++;
+  }
+#endif
+  if (runScript()) {
+    return; // The modem is being set up; links wait
+  }
+  for (int i = 0; i < STATIONLINKS; i++) {
+    Link *l = &links[i];
+    if (l->state == AWAITRESPONSE) {
+      processLink(i);
+    } else if (l->state == IDLE && l->request == NULL && !l->closed
+        && (!keepAlive || millis() - l->timeoutStart > keepAliveTimeout)) {
+      l->state = CIPCLOSE; // Kept-alive connection has been idle too long
+    }
+  }
   switch (state) {
     case IDLE:
       {
+      if (cancelRequested) {
+        cancelPending();
+      }
       bool autoCheck = doAutoConn
         && (millis() - lastConnectionCheck > CONNCHECK_TIMEOUT || reqReconn);
       if (ssid[0] != '\0' && (newNetworkInfo || autoCheck)) {
         // If we have an SSID, and it's new (or it's time to refresh),
         // then check network connection and reconnect if needed
-        emptyRxAndBuffer();
+        clearBuffer();
         wifiSerial.println(AT_CIPSTATUS);
         timeoutStart = millis();
         newNetworkInfo = false;
         state = CIPSTATUS;
-      } else if (connected && hasRequest) { // Process the request
-        emptyRxAndBuffer();
-        if (request_p->ssl)
-          wifiSerial.print(AT_CIPSTART_SSL);
-        else
-          wifiSerial.print(AT_CIPSTART);
-        wifiSerial.print("\"");
-        wifiSerial.print((char *)request_p->domain);
-        wifiSerial.print("\",");
-        wifiSerial.println(request_p->port);
-        timeoutStart = millis();
-        responseReady = false;
-        state = CIPSTART;
+      } else {
+        dispatchLink(); // Close, reconnect or start a link if one needs it
       }
       reqReconn = false;
       }
       break;
     case CIPSTATUS:
-      if (isTargetInResp(OK)) {
+      if (isTargetInResp(OK_TOK)) {
         int status = getStatusFromResp();
         if (status == -1) {
+#if ESP_METRICS
+          countFailure(FAIL_CIPSTATUS);
+#endif
           if (serialYes) {
             Serial.println("Couldn't determine connection status");
           }
           lastConnectionCheck = millis();
           connected = false;
           reqReconn = true;
-          emptyRxAndBuffer();
+          clearBuffer();
           state = IDLE;
         } else if (status == 2 || status == 3 || status == 4) {
           lastConnectionCheck = millis();
           connected = true;
-          emptyRxAndBuffer();
+          clearBuffer();
           state = IDLE; // Connection ok, return to idle
         } else {
+#if ESP_METRICS
+          countFailure(FAIL_RECONNECT);
+#endif
           if (serialYes) {
             Serial.println("Not connected, attempting to connect");
           }
           connected = false;
-          emptyRxAndBuffer();
+          clearBuffer();
           wifiSerial.print(AT_CWJAP);
           wifiSerial.print("\"");
           wifiSerial.print((char *)ssid);
@@ -776,7 +1460,11 @@ void ESP8266::processInterrupt() {
           timeoutStart = millis();
           state = CWJAP;
         }
-      } else if (isTargetInResp(ERROR)) {
+      } else if (isTargetInResp(ERROR_TOK)) {
+#if ESP_METRICS
+        countFailure(FAIL_ERROR);
+        countFailure(FAIL_CIPSTATUS);
+#endif
         if (serialYes) {
           Serial.println(debugCount);
           debugCount = 0;
@@ -785,152 +1473,109 @@ void ESP8266::processInterrupt() {
         lastConnectionCheck = millis();
         connected = false;
         reqReconn = true;
-        emptyRxAndBuffer();
+        clearBuffer();
         state = IDLE;
       } else if (millis() - timeoutStart > CIPSTATUS_TIMEOUT) {
+#if ESP_METRICS
+        countFailure(FAIL_TIMEOUT);
+        countFailure(FAIL_CIPSTATUS);
+#endif
         if (serialYes) {
           Serial.println("\nCIPSTATUS timed out");
         }
         lastConnectionCheck = millis();
         connected = false;
         reqReconn = true;
-        emptyRxAndBuffer();
+        clearBuffer();
         state = IDLE; // Hopefully it'll work next time
       }
       break;
     case CWJAP:
-      if (isTargetInResp(OK)) {
+      if (isTargetInResp(OK_TOK)) {
         lastConnectionCheck = millis(); //Connection succeeded
         connected = true;
-        emptyRxAndBuffer();
+        clearBuffer();
         state = IDLE;
-      } else if (isTargetInResp(FAIL)) {
+      } else if (isTargetInResp(FAIL_TOK)) {
+#if ESP_METRICS
+        countFailure(FAIL_ERROR);
+#endif
         lastConnectionCheck = millis();
-        emptyRxAndBuffer();
+        clearBuffer();
         state = IDLE;
-      } else if (isTargetInResp(ERROR)) { //This shouldn't happen
+      } else if (isTargetInResp(ERROR_TOK)) { //This shouldn't happen
+#if ESP_METRICS
+        countFailure(FAIL_ERROR);
+#endif
         if (serialYes) {
           Serial.println("\nMalformed CWJAP instruction");
         }
         lastConnectionCheck = millis();
-        emptyRxAndBuffer();
+        clearBuffer();
         state = IDLE;
       } else if (millis() - timeoutStart > CWJAP_TIMEOUT) {
+#if ESP_METRICS
+        countFailure(FAIL_TIMEOUT);
+#endif
         if (serialYes) {
           Serial.println("\nCWJAP instruction timed out");
         }
         lastConnectionCheck = millis();
-        emptyRxAndBuffer();
+        clearBuffer();
         state = IDLE;
       }
       break;
     case CIPSTART:
-      if (isTargetInResp(CLOSED)) {
-        Serial.println("Connect failed, retrying...");
-        timeoutStart = millis();
-        state = IDLE;
-      } else if ((isTargetInResp(ERROR) && isTargetInResp(ALREADY_CONNECTED))
-          || isTargetInResp(OK)) {
-        //Compute the length of the request
-        int len = DATASIZE;
-        // if (request_p->big) {  // large request
-        //     len = DATASIZE;
-        // }
-        // else {
-        //   len = strlen((char *)request_p->domain)
-        //     + strlen((char *)request_p->path)
-        //     + strlen((char *)request_p->data);
-        //   char portString[8];
-        //   char dataLenString[8];
-        //   sprintf(portString, "%d", request_p->port);
-        //   sprintf(dataLenString, "%d", strlen((char *)request_p->data));
-        //   len += strlen(portString);
-        //   if (request_p->type==GET_REQ) {
-        //     len += HTTP_GET_FIXED_LEN;
-        //   } else {
-        //     len += strlen(dataLenString);
-        //     len += HTTP_POST_JSON_FIXED_LEN;
-        //   }
-        //   if (request_p->data_offset != NULL) {
-        //     len = strlen((char *)request_p->domain)
-        //       + strlen((char *)request_p->path);
-        //     len += strlen(portString);
-        //     len += HTTP_JSON_CHUNKED_FIXED_LEN;
-        //   }
-        // }
-        emptyRxAndBuffer();
-        wifiSerial.print(AT_CIPSEND);
-        wifiSerial.println(len);
-        timeoutStart = millis();
-        state = CIPSEND;
-      } else if (isTargetInResp(ERROR)) {
+      if (links[activeLink].closed) {
+#if ESP_METRICS
+        countFailure(FAIL_CLOSED);
+#endif
+        if (serialYes) {
+          Serial.println("Connection refused");
+        }
+        failLink(activeLink, false);
+      } else if ((isTargetInResp(ERROR_TOK) && isTargetInResp(ALREADY_CONNECTED_TOK))
+          || isTargetInResp(OK_TOK)) {
+#if ESP_TIMING
+        request_p->timing.connected = micros();
+#endif
+        startSend(activeLink);
+      } else if (isTargetInResp(ERROR_TOK)) {
+#if ESP_METRICS
+        countFailure(FAIL_ERROR);
+#endif
         if (serialYes) {
           Serial.println("Could not make TCP connection");
         }
-        emptyRxAndBuffer();
-        hasRequest = request_p->auto_retry;
-        state = IDLE;
+        failLink(activeLink, false);
       } else if (millis() - timeoutStart > CIPSTART_TIMEOUT) {
+#if ESP_METRICS
+        countFailure(FAIL_TIMEOUT);
+#endif
         if (serialYes) {
           Serial.println("TCP connection attempt timed out");
         }
-        emptyRxAndBuffer();
-        hasRequest = request_p->auto_retry;
-        state = IDLE;
+        failLink(activeLink, false);
       }
       break;
     case CIPSEND:
-      if (isTargetInResp(OK_PROMPT)) {
-        emptyRxAndBuffer();
-        if (request_p->big) { // only posts
-          if (request_p->data_offset == 0) {
-            wifiSerial.print(HTTP_POST);
-            wifiSerial.print((char *)request_p->path);
-            wifiSerial.print(HTTP_0);
-            wifiSerial.print((char *)request_p->domain);
-            wifiSerial.print(":");
-            wifiSerial.print(request_p->port);
-            wifiSerial.print(HTTP_JSON);
-            wifiSerial.print(HTTP_CHUNKED);
-            wifiSerial.print(HTTP_END);
-            wifiSerial.print("\\0");
-            state = CIPSTART;
-            request_p->data_offset = -1;
-          } else {
-            if (request_p->data_offset == -1) request_p->data_offset = 0;
-            char chunkString[8];
-            int remaining = request_p->data_len - request_p->data_offset;
-            if (remaining >= DATASIZE-7) {
-              sprintf((char *)request_p->data, "%X\r\n", DATASIZE-7);
-              memcpy((void *)request_p->data+5, (void *)request_p->data_ref+request_p->data_offset, DATASIZE-7);
-              request_p->data[2046]='\r';
-              request_p->data[2047]='\n';
-              request_p->data_offset += DATASIZE-7;
-              state = CIPSTART;
-              Serial.println((char *)request_p->data);
-              wifiSerial.print((char *) request_p->data);
-              wifiSerial.print("\\0");
-            } else if (remaining > 0) {
-              sprintf(chunkString, "%X", remaining);
-              int chunk_len = strlen(chunkString);
-              sprintf((char *)request_p->data, "%X\r\n", remaining);
-              memcpy((void *)request_p->data+chunk_len+2, (void *)request_p->data_ref+request_p->data_offset, remaining);
-              request_p->data[remaining+chunk_len+2] = '\r';
-              request_p->data[remaining+chunk_len+3] = '\n';
-              request_p->data[remaining+chunk_len+4] = '\0';
-              request_p->data_offset += remaining;
-              Serial.println((char *)request_p->data);
-              wifiSerial.print((char *) request_p->data);
-              wifiSerial.print("\\0");
-              state = CIPSTART;
-            } else {
-              wifiSerial.print("0\r\n\r\n");
-              wifiSerial.print("\\0");
-              state = DATAOUT;
-            }
-          }
+      if (isTargetInResp(OK_PROMPT_TOK)) {
+        clearBuffer();
+#if ESP_TIMING
+        if (request_p->timing.prompt == 0) {
+          request_p->timing.prompt = micros();
+        }
+#endif
+#if ESP_UPLOADS
+        if (request_p->big) { // Head and chunks built by prepareSend()
+          wifiSerial.write((const uint8_t *)request_p->data, request_p->send_len);
+          request_p->prepared = false;
+          request_p->body_sent = true;
+          state = request_p->body_done ? DATAOUT : CHUNKOUT;
           timeoutStart = millis();
-        } else {
+        } else
+#endif
+        {
           if (request_p->type == GET_REQ) {
             wifiSerial.print(HTTP_GET);
             wifiSerial.print((char *)request_p->path);
@@ -941,7 +1586,6 @@ void ESP8266::processInterrupt() {
             wifiSerial.print(":");
             wifiSerial.print(request_p->port);
             wifiSerial.print(HTTP_END);
-            wifiSerial.print("\\0");
             if (serialYes) {
               Serial.print(HTTP_GET);
               Serial.print((char *)request_p->path);
@@ -965,7 +1609,6 @@ void ESP8266::processInterrupt() {
             wifiSerial.print(HTTP_2);
             wifiSerial.print(HTTP_END);
             wifiSerial.print((char *)request_p->data);
-            wifiSerial.print("\\0");
             if (serialYes) {
               Serial.print(HTTP_POST);
               Serial.print((char *)request_p->path);
@@ -982,391 +1625,1223 @@ void ESP8266::processInterrupt() {
           }
           state = DATAOUT;
         }
-      } else if (isTargetInResp(ERROR)) {
+        links[activeLink].state = state;
+      } else if (isTargetInResp(ERROR_TOK)) {
+#if ESP_METRICS
+        countFailure(FAIL_ERROR);
+#endif
         if (serialYes) {
           Serial.println("CIPSEND command failed");
         }
-        wifiSerial.println(AT_CIPCLOSE);
-        hasRequest = request_p->auto_retry;
-        state = IDLE;
+        if (!reconnectLink(activeLink)) {
+          failLink(activeLink, true);
+        }
       } else if (millis() - timeoutStart > CIPSEND_TIMEOUT) {
+#if ESP_METRICS
+        countFailure(FAIL_TIMEOUT);
+#endif
         if (serialYes) {
           Serial.println("CIPSEND command timed out");
         }
-        wifiSerial.println(AT_CIPCLOSE);
-        hasRequest = request_p->auto_retry;
-        state = IDLE;
+        failLink(activeLink, true);
+      }
+      break;
+#if ESP_UPLOADS
+    case CHUNKOUT:
+      if (isTargetInResp(SEND_OK_TOK)) {
+        transmitCount++;
+        startSend(activeLink); // Next part of the body, right away
+      } else if (isTargetInResp(ERROR_TOK) || isTargetInResp(SEND_FAIL_TOK)
+          || millis() - timeoutStart > DATAOUT_TIMEOUT) {
+#if ESP_METRICS
+        countFailure(isTargetInResp(SEND_FAIL_TOK) ? FAIL_SEND_FAIL
+            : isTargetInResp(ERROR_TOK) ? FAIL_ERROR : FAIL_TIMEOUT);
+#endif
+        clearBuffer();
+        if (serialYes) {
+          Serial.println("Problem sending upload");
+        }
+        if (!reconnectLink(activeLink)) {
+          failLink(activeLink, true);
+        }
       }
       break;
+#endif
     case DATAOUT:
-      if (isTargetInResp(SEND_OK)) {
-        emptyRxAndBuffer();
-        timeoutStart = millis();
+      if (isTargetInResp(SEND_OK_TOK)) {
+        clearBuffer();
         transmitCount++; // ESP8266 has successfully sent request out into the world
-        state = AWAITRESPONSE;
-        benchmark = millis();
-      } else if (isTargetInResp(ERROR)) {
-        emptyRxAndBuffer();
+#if ESP_TIMING
+        request_p->timing.sent = micros();
+#endif
+        links[activeLink].timeoutStart = millis();
+        links[activeLink].rxTime = links[activeLink].timeoutStart;
+        links[activeLink].state = AWAITRESPONSE; // Frees the channel
+        activeLink = -1;
+        state = IDLE;
+      } else if (isTargetInResp(ERROR_TOK)) {
+#if ESP_METRICS
+        countFailure(FAIL_ERROR);
+#endif
+        clearBuffer();
         if (serialYes) {
           Serial.println("Problem sending HTTP data");
         }
-        wifiSerial.println(AT_CIPCLOSE);
-        hasRequest = request_p->auto_retry;
-        state = IDLE;
+        if (!reconnectLink(activeLink)) {
+          failLink(activeLink, true);
+        }
       } else if (millis() - timeoutStart > DATAOUT_TIMEOUT) {
-        emptyRxAndBuffer();
+#if ESP_METRICS
+        countFailure(FAIL_TIMEOUT);
+#endif
+        clearBuffer();
         if (serialYes) {
           Serial.println("Timeout while confirming HTTP send");
         }
-        wifiSerial.println(AT_CIPCLOSE);
-        hasRequest = request_p->auto_retry;
-        state = IDLE;
-      } else if (isTargetInResp(SEND_FAIL)){
-        emptyRxAndBuffer();
+        failLink(activeLink, true);
+      } else if (isTargetInResp(SEND_FAIL_TOK)){
+#if ESP_METRICS
+        countFailure(FAIL_SEND_FAIL);
+#endif
+        clearBuffer();
         if (serialYes) {
           Serial.println("Failed to send HTTP");
         }
-        wifiSerial.println(AT_CIPCLOSE);
-        hasRequest = request_p->auto_retry;
-        state = IDLE;
+        if (!reconnectLink(activeLink)) {
+          failLink(activeLink, true);
+        }
       }
       break;
-    case AWAITRESPONSE:
-      if (isTargetInResp(HTML_END)) {
-        benchmark = millis() - benchmark;
-        getStringFromResp(HTML_START, HTML_END, (char *)response);
-        if (serialYes) {
-          Serial.println("Got HTTP response!");
-          Serial.print("Response speed: ");
-          Serial.println(benchmark);
-        }
-        wifiSerial.println(AT_CIPCLOSE);
-        hasRequest = false; //We're done with this request
-        responseReady = true;
-        receiveCount++; // ESP8266 has successfully received a response from the web
-        debugCount++;
-        emptyRxAndBuffer();
-        state = IDLE;
-      } else if (isTargetInResp("\",")) {
-        getStringFromResp("transcript", "\",", (char *)response);
-        wifiSerial.println(AT_CIPCLOSE);
-        hasRequest = false; //We're done with this request
-        responseReady = true;
-        receiveCount++; // ESP8266 has successfully received a response from the web
-        debugCount++;
-        emptyRxAndBuffer();
-      }
-      else if (millis() - timeoutStart > HTTP_TIMEOUT /*&& !isTargetInResp(IPD)*/) {
-        if (serialYes) {
-          Serial.println(debugCount);
-          debugCount = 0;
-          Serial.println("HTTP timeout");
+    case CIPCLOSE:
+      if (isTargetInResp(OK_TOK) || isTargetInResp(ERROR_TOK)
+          || millis() - timeoutStart > CIPCLOSE_TIMEOUT) {
+#if ESP_METRICS
+        if (!isTargetInResp(OK_TOK) && !isTargetInResp(ERROR_TOK)) {
+          countFailure(FAIL_TIMEOUT);
         }
-        wifiSerial.println(AT_CIPCLOSE);
-        hasRequest = request_p->auto_retry;
-        emptyRxAndBuffer();
-        state = IDLE;
-      } else if (isTargetInResp(CLOSED)){
-        hasRequest = request_p->auto_retry;
-        emptyRxAndBuffer();
+#endif
+        clearBuffer();
+        links[activeLink].closed = true;
+        links[activeLink].state = IDLE; // Reconnects if it kept its request
+        activeLink = -1;
         state = IDLE;
       }
       break;
+    case AWAITRESPONSE: // Only ever a link state
+      state = IDLE;
+      break;
   }
 }
 
-//Main interrupt handler for Access Point Mode
-void ESP8266::processInterruptAP(){
-  switch(stateAP) {
-    case RESET:
-      {
-      if(isTargetInResp(ERROR)){
-        if (serialYes){
-          Serial.println("Server Disconnected");
-          Serial.println("Attempting to restart the server");
-        }
-        setServer();
-        if(serverStatus){
-        stateAP = AWAITCLIENT;
-        }
-      }
-      else{
-        stateAP = AWAITCLIENT;
+// Checks a link that is waiting for its HTTP response.  linkReceive() parses
+// it as it arrives, so the link finishes as soon as the body is complete.
+void ESP8266::processLink(int id) {
+  Link *l = &links[id];
+  if (l->http.phase == HTTP_DONE
+      || (l->closed && l->http.phase == HTTP_BODY && l->http.remaining < 0)) {
+    benchmark = millis() - l->timeoutStart;
+    finishLink(id);
+    if (serialYes) {
+      Serial.println("Got HTTP response!");
+      Serial.print("Response speed: ");
+      Serial.println(benchmark);
+    }
+    receiveCount++; // ESP8266 has successfully received a response from the web
+    debugCount++;
+  } else if (millis() - l->rxTime > HTTP_TIMEOUT) { // Server went quiet
+#if ESP_METRICS
+    countFailure(FAIL_TIMEOUT, AWAITRESPONSE);
+#endif
+    if (serialYes) {
+      Serial.println(debugCount);
+      debugCount = 0;
+      Serial.println("HTTP timeout");
+    }
+    failLink(id, true);
+  } else if (l->closed) {
+#if ESP_METRICS
+    countFailure(FAIL_CLOSED, AWAITRESPONSE);
+#endif
+    if (l->rxTotal > 0 || !reconnectLink(id)) {
+      failLink(id, false);
+    }
+  }
+}
+
+// Gives the command channel to the next link that needs it.  Pending closes
+// go first so links and response slots are freed as soon as possible.
+// Returns true if a command was issued.
+bool ESP8266::dispatchLink() {
+  for (int i = 0; i < STATIONLINKS; i++) {
+    if (links[i].state == CIPCLOSE) {
+      if (links[i].closed) { // Nothing open on this link
+        links[i].state = IDLE;
+      } else {
+        clearBuffer();
+        wifiSerial.print(AT_CIPCLOSE);
+        wifiSerial.println(i);
+        activeLink = i;
         timeoutStart = millis();
-        serverStatus = true;
+        state = CIPCLOSE;
+        return true;
       }
-      break;
+    }
+  }
+  if (!connected) {
+    return false;
+  }
+  for (int i = 0; i < STATIONLINKS; i++) {
+    if (links[i].state == IDLE && links[i].request != NULL
+        && (!links[i].retryWait
+          || millis() - links[i].timeoutStart > RETRY_DELAY)) { // Retry
+      startLink(i);
+      return true;
+    }
+  }
+  if (requestNext == requestHead
+      || !requestQueue[requestNext & (REQUESTQUEUESIZE-1)].ready) {
+    return false; // Nothing queued, or the next one is still being filled in
+  }
+  volatile Request *r = &requestQueue[requestNext & (REQUESTQUEUESIZE-1)];
+  if (r->done) { // Abandoned by the request builder
+    requestNext++;
+    retireRequests();
+    return dispatchLink();
+  }
+  int id = -1;
+  bool reuse = false;
+  for (int i = 0; i < STATIONLINKS && id < 0; i++) {
+    if (links[i].state == IDLE && links[i].request == NULL
+        && !links[i].closed && linkGoesTo(i, r)) {
+      id = i;
+      reuse = true;
+    }
+  }
+  for (int i = 0; i < STATIONLINKS && id < 0; i++) {
+    if (links[i].state == IDLE && links[i].request == NULL && links[i].closed) {
+      id = i;
+    }
+  }
+  if (id < 0) { // Close the longest idle kept-alive connection to make room
+    int oldest = -1;
+    for (int i = 0; i < STATIONLINKS; i++) {
+      if (links[i].state == IDLE && links[i].request == NULL && (oldest < 0
+          || links[i].timeoutStart - links[oldest].timeoutStart > 0x7FFFFFFF)) {
+        oldest = i;
       }
-    case AWAITCLIENT:
-      {
-      // get link id
-      if(getStringFromResp("IPD",":",(char *)response)){
-        hasRequest = true;
-        String resp = (char *)response;
+    }
+    if (oldest >= 0) {
+      links[oldest].state = CIPCLOSE;
+      return dispatchLink();
+    }
+  }
+  int slot = -1;
+  for (int i = 0; i < RESPONSEQUEUESIZE && slot < 0; i++) {
+    if (slotFree[i]) {
+      slot = i;
+    }
+  }
+  if (id >= 0 && slot < 0 && responseHead != responseTail) {
+    int oldest = completionQueue[responseTail & (RESPONSEQUEUESIZE-1)];
+    if (oldest != readingSlot) { // Make room by dropping the oldest response
+#if ESP_METRICS
+      countFailure(FAIL_OVERFLOW);
+#endif
+      if (serialYes) {
+        Serial.println("WARNING: dropping unread response");
+      }
+      responseTail++;
+      slot = oldest;
+    }
+  }
+  if (id < 0 || slot < 0) {
+    return false; // Wait for a link or response slot to free up
+  }
+  slotFree[slot] = false;
+  links[id].slot = slot;
+  links[id].request = r;
+  requestNext++;
+#if ESP_TIMING
+  r->timing.started = micros();
+  r->timing.connected = 0;
+  r->timing.prompt = 0;
+#endif
+  if (reuse) { // Already connected, go straight to sending
+    links[id].reused = true;
+    resetReceive(id);
+    startSend(id);
+  } else {
+    startLink(id);
+  }
+  return true;
+}
 
-            linkID = int(resp[4]) - 48;
+// Opens the TCP connection for a link's request
+void ESP8266::startLink(int id) {
+  Link *l = &links[id];
+  activeLink = id;
+  request_p = l->request;
+  l->closed = false;
+  l->reused = false;
+  l->retryWait = false;
+#if ESP_TIMING
+  request_p->timing.started = micros(); // Again, if this is a retry
+  request_p->timing.connected = 0;
+  request_p->timing.prompt = 0;
+#endif
+  strcpy((char *)l->domain, (char *)request_p->domain);
+  l->port = request_p->port;
+  l->ssl = request_p->ssl;
+  resetReceive(id);
+  clearBuffer();
+  wifiSerial.print(AT_CIPSTART);
+  wifiSerial.print(id);
+  if (request_p->ssl)
+    wifiSerial.print(CIPSTART_SSL);
+  else
+    wifiSerial.print(CIPSTART_TCP);
+  wifiSerial.print("\"");
+  wifiSerial.print((char *)request_p->domain);
+  wifiSerial.print("\",");
+  wifiSerial.println(request_p->port);
+  timeoutStart = millis();
+  l->state = CIPSTART;
+  state = CIPSTART;
+}
 
-            if (serialYes){
+// Asks the modem for the prompt to send a link's request on its open
+// connection.  The link takes (or keeps) the command channel.
+void ESP8266::startSend(int id) {
+  activeLink = id;
+  request_p = links[id].request;
+  int len = prepareSend();
+  clearBuffer();
+  wifiSerial.print(AT_CIPSEND);
+  wifiSerial.print(id);
+  wifiSerial.print(",");
+  wifiSerial.println(len);
+  timeoutStart = millis();
+  state = CIPSEND;
+  links[id].state = CIPSEND;
+}
 
-              Serial.println();
-              Serial.print("linkID: ");
-              Serial.println(linkID);
-              Serial.print("resp: ");
-              Serial.println(resp);
+// Works out exactly what the next CIPSEND for request_p carries, and
+// returns its length.  For big requests this also builds the send in
+// request_p->data: the head (first send only), then as many chunks (size
+// line, data and CRLF) as fit, and the last chunk once the body runs out.
+int ESP8266::prepareSend() {
+  volatile Request *r = request_p;
+#if ESP_UPLOADS
+  if (r->big) {
+    if (!r->prepared) { // Else it's still waiting to go out
+      r->send_len = buildUpload(r);
+      r->prepared = true;
+    }
+    return r->send_len;
+  }
+#endif
+  r->send_len = requestLength(r->type, strlen((char *)r->domain), r->port,
+      strlen((char *)r->path), strlen((char *)r->data));
+  return r->send_len;
+}
 
-          }
-          timeoutStart = millis();
-          first = true;
-            stateAP = AWAITREQUEST;
-            responseReady = true;
-        }
-      else if(getStringFromResp("PD",":",(char *)response)){
-            hasRequest = true;
-            String resp = (char *)response;
+// Length of the GET or POST the CIPSEND state writes for these parts.  It
+// must be at most CIPSEND_MAX, or the modem refuses the send.
+int ESP8266::requestLength(RequestType type, size_t domainLen, int port, size_t pathLen, size_t dataLen) {
+  int len = pathLen + domainLen + numDigits(port, 10) + dataLen;
+  if (type == GET_REQ) {
+    len += HTTP_GET_FIXED_LEN;
+  } else {
+    len += numDigits(dataLen, 10) + HTTP_POST_FIXED_LEN;
+  }
+  return len;
+}
 
-            linkID = int(resp[3]) - 48;
+#if ESP_UPLOADS
+// Fills r->data with up to DATASIZE bytes of a big request, see above
+int ESP8266::buildUpload(volatile Request *r) {
+  char *buf = (char *)r->data;
+  int len = 0;
+  if (!r->body_sent) {
+    // openUpload() made sure this fits
+    len = snprintf(buf, DATASIZE+1, "%s%s%s%s:%d%s%s%s", HTTP_POST,
+        (char *)r->path, HTTP_0, (char *)r->domain, r->port, HTTP_JSON,
+        HTTP_CHUNKED, HTTP_END);
+  }
+  while (!r->body_done) {
+    int room = DATASIZE - len - CHUNKOVERHEAD;
+    if (!r->source_done && room > 0) {
+      int n = fillUpload(r, buf + len + CHUNKSIZELEN, room);
+      if (n > 0) {
+        char sizeLine[sizeof(int)*2+3]; // Any int in hex, CRLF and null
+        int h = snprintf(sizeLine, sizeof(sizeLine), "%X\r\n", n);
+        memmove(buf + len + h, buf + len + CHUNKSIZELEN, n);
+        memcpy(buf + len, sizeLine, h);
+        len += h + n;
+        buf[len++] = '\r';
+        buf[len++] = '\n';
+        continue;
+      }
+      r->source_done = true;
+    }
+    if (!r->source_done || DATASIZE - len < (int)strlen(HTTP_CHUNK_END)) {
+      break; // Full; the rest goes in the next send
+    }
+    strcpy(buf + len, HTTP_CHUNK_END);
+    len += strlen(HTTP_CHUNK_END);
+    r->body_done = true;
+  }
+  return len;
+}
 
-            if (serialYes){
+// Takes up to len bytes of a big request's body from its source into buf
+int ESP8266::fillUpload(volatile Request *r, char *buf, int len) {
+  ESP_STACK_MARK();
+  if (r->source != NULL) {
+    int n = r->source(buf, len);
+    return n > len ? len : n;
+  }
+  int n = r->data_len - r->data_offset;
+  if (n > len) {
+    n = len;
+  }
+  memcpy(buf, (char *)r->data_ref + r->data_offset, n);
+  r->data_offset += n;
+  return n;
+}
+#endif
+
+// Gets a request ready to be sent again from the start.  Returns false if
+// that's impossible because part of a producer's upload already went out.
+bool ESP8266::rewindRequest(volatile Request *r) {
+#if ESP_UPLOADS
+  if (r->body_sent) {
+    if (r->source != NULL) {
+      return false;
+    }
+    r->data_offset = 0;
+    r->prepared = false;
+    r->source_done = false;
+    r->body_done = false;
+    r->body_sent = false;
+  }
+#else
+  (void)r;
+#endif
+  return true;
+}
 
-              Serial.println();
-              Serial.print("linkID: ");
-              Serial.println(linkID);
-              Serial.print("resp: ");
-              Serial.println(resp);
+// Number of digits in n (n >= 0) written in the given base
+int ESP8266::numDigits(long n, int base) {
+  int digits = 1;
+  while (n >= base) {
+    n /= base;
+    digits++;
+  }
+  return digits;
+}
 
-          }
-          timeoutStart = millis();
-          first = true;
-            stateAP = AWAITREQUEST;
-            responseReady = true;
-        }
-        /*else if(millis() - timeoutStart > CHECK_TIMEOUT || serverStatus == false){
-          emptyRxAndBuffer();
-          wifiSerial.println(AT_CWSAP_GET);
-          stateAP = RESET;
-        }*/
-      else {
-          if (serialYes and first){
-            first = false;
-            Serial.println();
-            Serial.println("ESP8266 AWAITCLIENT");
-          }
-        }
-      break;
-      }
-      case AWAITREQUEST:
-       {
-      if (getStringFromResp("POST", "Host",(char *)response)){
-        String resp = (char *)response;
-        requestAP_p->typeAP = POST_REQ;
-        requestParse(resp);
-        timeoutStart = millis();
-        first = true;
-        stateAP = SENDRESPONSE;
-      }
-      else if (getStringFromResp("GET", "Host",(char *)response)){
-        String resp = (char *)response;
-        requestAP_p->typeAP = GET_REQ;
-        requestParse(resp);
-        timeoutStart = millis();
-        first = true;
-        stateAP = SENDRESPONSE;
-      }
-      else if ((millis()-timeoutStart) > AWAITREQUEST_TIMEOUT){
-        if (serialYes){
-          Serial.println();
-          Serial.println("Received an incomplete request");
-        }
-        stateAP = AWAITCLIENT;
-      }
-    break;
-    }
-      case SENDRESPONSE:
-      {
-        if(first){
-          wifiSerial.print(AT_CIPSEND);
-        wifiSerial.print(linkID);
-          findPage();
-          first = false;
-        }
-        if(isTargetInResp(OK_PROMPT)){
-          emptyRxAndBuffer();
-          servePage();
-          if (serialYes){
-            Serial.println();
-            Serial.println("Got prompt");
-          }
-          timeoutStart = millis();
-          first = true;
-          stateAP = DATAOUTAP;
-        }
-        else if(isTargetInResp(ERROR)){
-          emptyRxAndBuffer();
-          stateAP = CLOSE;
-        }
-        else if (millis() - timeoutStart > SENDRESPONSE_TIMEOUT){
-          timeoutStart = millis();
-          stateAP = CLOSE;
-          if (serialYes){
-            Serial.println();
-            Serial.println("CIPSEND TIMEOUT");
-          }
-        }
-      break;
+// Publishes the link's response and retires its request
+void ESP8266::finishLink(int id) {
+  Link *l = &links[id];
+  response[l->slot][l->rxLen] = '\0'; // In case no body arrived
+  responseStatus[l->slot] = l->http.status;
+#if ESP_TIMING
+  recordTiming(id);
+#endif
+  completionQueue[responseHead & (RESPONSEQUEUESIZE-1)] = l->slot;
+  ESP_BARRIER();
+  responseHead++; // Hand the slot to user calls
+  l->slot = -1;
+  endRequest(l->request, true);
+  l->request = NULL;
+  retireRequests();
+  l->timeoutStart = millis(); // Start of idle time, if kept alive
+  l->state = keepAlive && !l->http.close ? IDLE : CIPCLOSE;
+}
+
+// A kept-alive connection turned out to have been closed by the server.
+// Sends the request again on a new connection, once, without counting it as
+// a failure.  Returns false if the link wasn't reusing a connection.
+bool ESP8266::reconnectLink(int id) {
+  Link *l = &links[id];
+  if (!l->reused || !rewindRequest(l->request)) {
+    return false;
+  }
+#if ESP_METRICS
+  countFailure(FAIL_RECONNECT, l->state);
+#endif
+  if (serialYes) {
+    Serial.println("Kept-alive connection was closed, reconnecting");
+  }
+  l->reused = false;
+  l->state = CIPCLOSE; // Keeps its request, so reconnects after closing
+  if (id == activeLink) {
+    activeLink = -1;
+    state = IDLE;
+  }
+  return true;
+}
+
+// Returns true if the link's connection is the one r needs
+bool ESP8266::linkGoesTo(int id, volatile Request *r) {
+  Link *l = &links[id];
+  return l->port == r->port && l->ssl == r->ssl
+    && strcmp((char *)l->domain, (char *)r->domain) == 0;
+}
+
+// Gives up on the link's current attempt.  The request is kept for another
+// attempt if it asked for auto retry, made RETRY_DELAY later so a failing
+// host doesn't hold the command channel; either way the link is closed
+// first.  needClose is false if the modem has no connection open on the link.
+void ESP8266::failLink(int id, bool needClose) {
+  Link *l = &links[id];
+#if ESP_METRICS
+  if (l->request->auto_retry && !cancelRequested) {
+    countFailure(FAIL_RETRY, l->state);
+  }
+#endif
+  if (!l->request->auto_retry || cancelRequested) {
+    slotFree[l->slot] = true;
+    l->slot = -1;
+    endRequest(l->request, false);
+    l->request = NULL;
+    retireRequests();
+  } else {
+    l->retryWait = true;
+    l->timeoutStart = millis();
+  }
+  if (!needClose) {
+    l->closed = true;
+  }
+  l->state = CIPCLOSE;
+  if (id == activeLink) {
+    activeLink = -1;
+    state = IDLE;
+  }
+}
+
+#endif
+
+// Runs one tick of the startup scripts.  A pending script starts once the
+// command channel is free, and then has the modem to itself: each step sends
+// its command and waits for its target, ERROR or its timeout.  Returns true
+// while a script is running, so the caller's FSM waits.
+bool ESP8266::runScript() {
+  if (scriptRunning < 0) {
+    uint8_t pending = scriptsPending;
+    if (pending == 0) {
+      return false;
+    }
+    if (ESPmode == 0 ? state != IDLE : stateAP != AWAITCLIENT) {
+      return false; // Let the command in progress finish first
+    }
+    int script = 0;
+    while (!(pending & (1 << script))) {
+      script++;
+    }
+    __atomic_fetch_and((uint8_t *)&scriptsPending, (uint8_t)~(1 << script),
+        __ATOMIC_SEQ_CST);
+    scriptStep = 0;
+    stepSent = false;
+    stepTries = 0;
+    scriptReset = false;
+    scriptRunning = script;
+  }
+  const ScriptStep *step = &SCRIPTS[scriptRunning][scriptStep];
+  if (step->command == NULL) {
+    finishScript();
+    return true;
+  }
+  if (!stepSent) {
+    sendStep(step);
+    return true;
+  }
+  bool ok = isTargetInResp(step->target);
+  if (!ok && !isTargetInResp(ERROR_TOK)
+      && millis() - timeoutStart <= step->timeout) {
+    return true; // Still waiting
+  }
+  stepSent = false;
+#if ESP_METRICS
+  if (!ok) {
+    countFailure(isTargetInResp(ERROR_TOK) ? FAIL_ERROR : FAIL_TIMEOUT);
+  }
+#endif
+  if (ok) {
+    if (step->flags & STEP_MAC) {
+      getMACFromResp();
+    }
+    if (step->probe != NULL && strstr((char *)inputBuffer, step->probe)) {
+      scriptStep += step->skip; // Already set; skip setting it
+    }
+  } else if (++stepTries < step->tries) {
+    return true; // Send it again
+  } else {
+    if (serialYes) {
+      Serial.println();
+      Serial.print("Startup step failed: ");
+      Serial.println(step->command);
+    }
+    if (!(step->flags & STEP_OPTIONAL)) {
+      startupOk = false;
+    }
+    if (step->flags & STEP_ABORT) {
+      if (serialYes) {
+        Serial.println("ESP8266 not present");
       }
-      case DATAOUTAP:
-      {
-      if(isTargetInResp(SEND_OK)){
-          emptyRxAndBuffer();
+      scriptsPending = 0; // The rest would fail too
+      finishScript();
+      return true;
+    }
+  }
+  stepTries = 0;
+  scriptStep++;
+  return true;
+}
+
+// Sends a script step's command
+void ESP8266::sendStep(const ScriptStep *step) {
+  ESP_STACK_MARK();
+  clearBuffer();
+  if (step->flags & STEP_RESET) {
+    dropLinks();
+  }
+  if (step->flags & STEP_CWSAP) {
+    wifiSerial.print(step->command);
+    wifiSerial.print("\"");
+    wifiSerial.print((char *)ssid);
+    wifiSerial.print("\",\"");
+    wifiSerial.print((char *)password);
+    wifiSerial.println("\",1,4");
+  } else {
+    wifiSerial.println(step->command);
+  }
+  timeoutStart = millis();
+  stepSent = true;
+}
+
+// The modem is about to restart, which closes every connection.  Links with
+// a request start it again once the modem is back, unless some of a streamed
+// body was already handed over or some of a producer's upload sent.  Access
+// point clients are dropped.
+void ESP8266::dropLinks() {
+  scriptReset = true;
+#if ESP_AP
+  if (ESPmode == 1) {
+    for (int i = 0; i < APLINKS; i++) {
+      clients[i].state = CLIENT_IDLE;
+    }
+    activeClient = -1;
+    return;
+  }
+#endif
+#if ESP_STATION
+  connected = false;
+  for (int i = 0; i < STATIONLINKS; i++) {
+    Link *l = &links[i];
+    l->closed = true;
+    l->state = IDLE;
+#if ESP_STREAMING
+    bool streamStarted = l->request != NULL && l->request->stream
+      && l->rxTotal > 0;
+#else
+    bool streamStarted = false;
+#endif
+    if (l->request != NULL && (streamStarted || !rewindRequest(l->request))) {
+      slotFree[l->slot] = true; // Some of it is gone, can't start over
+      l->slot = -1;
+      endRequest(l->request, false);
+      l->request = NULL;
+    }
+  }
+  retireRequests();
+  activeLink = -1;
+#endif
+}
+
+void ESP8266::finishScript() {
+  if (serialYes) {
+    Serial.println();
+    Serial.print(SCRIPT_NAMES[scriptRunning]);
+    Serial.println(startupOk ? " done" : " failed");
+  }
+  if (scriptRunning == SERVER_SCRIPT) {
+    serverStatus = startupOk;
+  }
+  if (ESPmode == 0) {
+    if (scriptReset && ssid[0] != '\0') {
+      newNetworkInfo = true; // Rejoin the network the modem just left
+    }
+    state = IDLE;
+  } else {
+    stateAP = AWAITCLIENT;
+  }
+  clearBuffer();
+  scriptRunning = -1;
+}
+
+// Copies the MAC address out of the reply to AT+CIPAPMAC?, which looks like
+// +CIPAPMAC:"1a:fe:34:00:00:00"
+void ESP8266::getMACFromResp() {
+  char *start = strchr((char *)inputBuffer, '"');
+  if (start != NULL && strlen(start + 1) >= MACSIZE) {
+    memcpy((char *)MAC, start + 1, MACSIZE);
+    MAC[MACSIZE] = '\0';
+  } else if (serialYes) {
+    Serial.println("Couldn't read MAC address");
+  }
+}
+
+#if ESP_STATION
+// Handles clearRequest(): drops requests not yet given to a link, and stops
+// links from retrying the ones they have
+void ESP8266::cancelPending() {
+  while ((int8_t)(cancelHead - requestNext) > 0
+      && requestQueue[requestNext & (REQUESTQUEUESIZE-1)].ready) {
+    endRequest(&requestQueue[requestNext & (REQUESTQUEUESIZE-1)], false);
+    requestNext++;
+  }
+  for (int i = 0; i < STATIONLINKS; i++) {
+    Link *l = &links[i];
+    if (l->request != NULL) {
+      l->request->auto_retry = false;
+      if (l->state == IDLE) { // Was waiting to retry
+        slotFree[l->slot] = true;
+        l->slot = -1;
+        endRequest(l->request, false);
+        l->request = NULL;
+      }
+    }
+  }
+  retireRequests();
+  cancelRequested = false;
+}
+
+// Marks a request finished, ending its stream if it has one.  ok is false if
+// it failed or was cancelled.
+void ESP8266::endRequest(volatile Request *r, bool ok) {
+#if ESP_STREAMING
+  if (r->stream) {
+    if (!ok) {
+      streamFailed = true;
+    }
+    ESP_BARRIER();
+    streamEnded = true;
+  }
+#else
+  (void)ok;
+#endif
+  r->done = true;
+}
+
+#if ESP_TIMING
+// Stamps a link's request done, adds its phases to the totals, and keeps
+// its timing with its response
+void ESP8266::recordTiming(int id) {
+  Link *l = &links[id];
+  volatile RequestTiming *t = &l->request->timing;
+  t->done = micros();
+  timingSeq++;
+  ESP_BARRIER();
+  addPhase(PHASE_QUEUE, t->queued, t->started);
+  addPhase(PHASE_CONNECT, t->started, t->connected);
+  addPhase(PHASE_PROMPT, t->connected != 0 ? t->connected : t->started,
+      t->prompt);
+  addPhase(PHASE_SEND, t->prompt, t->sent);
+  addPhase(PHASE_SERVER, t->sent, t->firstByte);
+  addPhase(PHASE_RECEIVE, t->firstByte, t->done);
+  addPhase(PHASE_TOTAL, t->queued, t->done);
+  ESP_BARRIER();
+  timingSeq++;
+  memcpy(&responseTiming[l->slot], (const void *)t, sizeof(RequestTiming));
+}
+
+// Adds one request's time between two steps to a phase.  Skipped if the
+// request didn't reach both; the modem can report the response before SEND
+// OK, so a negative time counts as 0.
+void ESP8266::addPhase(int phase, uint32_t from, uint32_t to) {
+  if (from == 0 || to == 0) {
+    return;
+  }
+  uint32_t micros = (int32_t)(to - from) > 0 ? to - from : 0;
+  PhaseTotals *p = &phaseTotals[phase];
+  if (p->count == 0 || micros < p->min) {
+    p->min = micros;
+  }
+  if (micros > p->max) {
+    p->max = micros;
+  }
+  p->count++;
+  p->total += micros;
+  int b = timingBucket(micros);
+  if (p->buckets[b] == 0xFFFF) { // Halve them all, keeping the shape
+    for (int i = 0; i < TIMINGBUCKETS; i++) {
+      p->buckets[i] >>= 1;
+    }
+  }
+  p->buckets[b]++;
+}
+
+// Histogram bucket of a phase time: 0 and 1us get their own, then each
+// power of two is split in two halves.  Times from 2^28us go in the last.
+int ESP8266::timingBucket(uint32_t micros) {
+  if (micros < 2) {
+    return micros;
+  }
+  int log = 31 - __builtin_clz(micros);
+  int bucket = 2*log + ((micros >> (log - 1)) & 1);
+  return bucket < TIMINGBUCKETS ? bucket : TIMINGBUCKETS - 1;
+}
+#endif
+
+// Hands finished request slots back to user calls.  Links can finish out of
+// order, so this stops at the oldest request still in progress.
+void ESP8266::retireRequests() {
+  while (requestTail != requestNext
+      && requestQueue[requestTail & (REQUESTQUEUESIZE-1)].done) {
+    requestQueue[requestTail & (REQUESTQUEUESIZE-1)].ready = false;
+    ESP_BARRIER();
+    requestTail++;
+  }
+}
+
+//Main interrupt handler for Access Point Mode
+#endif
+
+#if ESP_AP
+void ESP8266::handleInterruptAP(void) {
+#if ESP_PROFILE
+    _instance->profileBegin();
+#endif
+    _instance->isrStackBase = (uintptr_t)__builtin_frame_address(0);
+    uint32_t before = _instance->tickState();
+    _instance->processInterruptAP();
+    _instance->adaptTick(before);
+    _instance->isrStackBase = 0;
+#if ESP_PROFILE
+    _instance->profileEnd();
+#endif
+}
+
+// Access point interrupt handler.  Client requests arrive as +IPD frames,
+// which loadRx() hands to clientReceive(), so any number of clients can be
+// sending at once.  The AT command channel is shared: stateAP tracks the one
+// command in progress, on behalf of activeClient.  Pages go out in CIPSENDs
+// of up to APSENDSIZE bytes, and the channel goes round the clients after
+// each one, so a big page doesn't hold up the others.
+void ESP8266::processInterruptAP(){
+  loadRx(); // Routes +IPD payloads to their clients
+  if (runScript()) {
+    return;
+  }
+  for (int i = 0; i < APLINKS; i++) {
+    Client *c = &clients[i];
+    if (c->state == CLIENT_RECEIVING
+        && millis() - c->timeoutStart > AWAITREQUEST_TIMEOUT) {
+#if ESP_METRICS
+      countFailure(FAIL_TIMEOUT);
+#endif
+      if (serialYes){
+        Serial.println();
+        Serial.println("Received an incomplete request");
+      }
+      c->state = CLIENT_CLOSING;
+    }
+  }
+  switch(stateAP) {
+    case AWAITCLIENT:
+      dispatchClient();
+      break;
+    case SENDRESPONSE:
+      if(isTargetInResp(OK_PROMPT_TOK)){
+        clearBuffer();
+        servePage();
         timeoutStart = millis();
-          stateAP = CLOSE;
-          if (serialYes){
-            Serial.println();
-            Serial.println("CIPSEND COMPLETE");
-          }
+        stateAP = DATAOUTAP;
+      }
+      else if(isTargetInResp(ERROR_TOK)
+          || millis() - timeoutStart > SENDRESPONSE_TIMEOUT){
+#if ESP_METRICS
+        countFailure(isTargetInResp(ERROR_TOK) ? FAIL_ERROR : FAIL_TIMEOUT);
+#endif
+        clearBuffer();
+        if (serialYes){
+          Serial.println();
+          Serial.println("CIPSEND ERROR");
         }
-        else if (millis() - timeoutStart > CIPSEND_TIMEOUT){
-          emptyRxAndBuffer();
-          first = true;
-          stateAP = AWAITCLIENT;
-          timeoutStart = millis();
+        clients[activeClient].state = CLIENT_CLOSING;
+        activeClient = -1;
+        stateAP = AWAITCLIENT;
+      }
+      break;
+    case DATAOUTAP:
+      if(isTargetInResp(SEND_OK_TOK)){
+        clearBuffer();
+        Client *c = &clients[activeClient];
+        c->sent += sendLen;
+        if (c->lastChunk) {
+          c->state = CLIENT_CLOSING;
           if (serialYes){
             Serial.println();
-            Serial.println("CIPSEND ERROR");
+            Serial.println("CIPSEND COMPLETE");
           }
         }
-      break;
+        activeClient = -1;
+        stateAP = AWAITCLIENT;
       }
-      case CLOSE:
-      {
-        if(isTargetInResp(CLOSED)){
-          emptyRxAndBuffer();
-          timeoutStart = millis();
-          stateAP = AWAITCLIENT;
-        }
-        if(isTargetInResp(OK)){
-          emptyRxAndBuffer();
-          timeoutStart = millis();
-          stateAP = AWAITCLIENT;
-        }
-        if(isTargetInResp(UNLINK)){
-          emptyRxAndBuffer();
-          timeoutStart = millis();
-          stateAP = AWAITCLIENT;
+      else if(isTargetInResp(ERROR_TOK) || isTargetInResp(SEND_FAIL_TOK)
+          || millis() - timeoutStart > CIPSEND_TIMEOUT){
+#if ESP_METRICS
+        countFailure(isTargetInResp(SEND_FAIL_TOK) ? FAIL_SEND_FAIL
+            : isTargetInResp(ERROR_TOK) ? FAIL_ERROR : FAIL_TIMEOUT);
+#endif
+        clearBuffer();
+        if (serialYes){
+          Serial.println();
+          Serial.println("CIPSEND ERROR");
         }
-        else if (millis() - timeoutStart > CLOSE_TIMEOUT){
-          wifiSerial.print(AT_CIPCLOSE_AP);
-          wifiSerial.println(linkID);
-          timeoutStart = millis();
+        clients[activeClient].state = CLIENT_CLOSING;
+        activeClient = -1;
+        stateAP = AWAITCLIENT;
+      }
+      break;
+    case CLOSE:
+      // ERROR means the client had closed already
+      if(isTargetInResp(OK_TOK) || isTargetInResp(ERROR_TOK)
+          || millis() - timeoutStart > CIPCLOSE_TIMEOUT){
+#if ESP_METRICS
+        if (!isTargetInResp(OK_TOK) && !isTargetInResp(ERROR_TOK)) {
+          countFailure(FAIL_TIMEOUT);
         }
-        hasRequest = false;
+#endif
+        clearBuffer();
+        endClient(activeClient);
+        activeClient = -1;
+        stateAP = AWAITCLIENT;
       }
+      break;
+  }
+}
+
+// Gives the free channel to the next client that needs it, going round the
+// clients from the one after the last served.  Returns false if none does.
+bool ESP8266::dispatchClient(){
+  for (int k = 0; k < APLINKS; k++) {
+    int id = (nextClient + k) % APLINKS;
+    Client *c = &clients[id];
+    if (c->state == CLIENT_SERVING) {
+      if (pagesBusy) {
+        continue; //setPage() is mid-write, try again next tick
+      }
+      if (c->route < 0) {
+        findPage(id);
+      }
+      sendLen = nextChunk(id);
+      if (sendLen < 0) {
+        c->state = CLIENT_CLOSING; // Page changed under it, start over
+        continue;
+      }
+      if (sendLen == 0) {
+        c->state = CLIENT_CLOSING; // Handler had nothing more to add
+        continue;
+      }
+      clearBuffer();
+      wifiSerial.print(AT_CIPSEND);
+      wifiSerial.print(id);
+      wifiSerial.print(",");
+      wifiSerial.println(sendLen);
+      stateAP = SENDRESPONSE;
+    } else if (c->state == CLIENT_CLOSING) {
+      clearBuffer();
+      wifiSerial.print(AT_CIPCLOSE_AP);
+      wifiSerial.println(id);
+      stateAP = CLOSE;
+    } else {
+      continue;
+    }
+    activeClient = id;
+    nextClient = (id + 1) % APLINKS;
+    timeoutStart = millis();
+    return true;
+  }
+  return false;
+}
+
+// Feeds one payload byte from a client to its request, cut to
+// APREQUESTSIZE.  Once the head's blank line arrives it is parsed, then
+// Content-Length bytes of body are taken and the client waits for its page.
+// Bytes after the body are ignored.
+void ESP8266::clientReceive(int id, char ch){
+  if (id < 0 || id >= APLINKS) {
+    return;
+  }
+  Client *c = &clients[id];
+  if (c->state == CLIENT_IDLE) {
+    c->state = CLIENT_RECEIVING;
+    c->rxLen = 0;
+    c->headMatch = 0;
+    c->complete = false;
+    c->fields.truncated = false;
+    c->timeoutStart = millis();
+  } else if (c->state != CLIENT_RECEIVING) {
+    return;
+  }
+  receiveCount++;
+  if (c->rxLen < APREQUESTSIZE - 1) {
+    c->request[c->rxLen++] = ch;
+    c->request[c->rxLen] = '\0';
+  } else {
+    c->fields.truncated = true;
+  }
+  if (c->headMatch < 4) {
+    if (ch == "\r\n\r\n"[c->headMatch]) {
+      c->headMatch++;
+    } else {
+      c->headMatch = ch == '\r' ? 1 : 0;
+    }
+    if (c->headMatch < 4) {
+      return;
+    }
+    requestParse(id);
+    c->bodyLeft = c->fields.contentLength;
+    c->fields.body.at = c->rxLen;
+    c->fields.body.len = 0;
+  } else {
+    c->bodyLeft--;
+    c->fields.body.len = c->rxLen - c->fields.body.at;
+  }
+  if (c->bodyLeft == 0) {
+    c->complete = true;
+    c->route = -1;
+    c->state = CLIENT_SERVING;
+  }
+}
 
+// Finishes with a client.  A complete request is handed to the user by
+// swapping buffers with the next free held request.  If the user is holding
+// APHELDREQUESTS already, it is dropped and counted as an overflow.
+void ESP8266::endClient(int id){
+  Client *c = &clients[id];
+  if (c->complete && (uint8_t)(heldHead - heldTail) < APHELDREQUESTS) {
+    int slot = heldHead & (APHELDREQUESTS-1);
+    char *held = heldRequests[slot];
+    heldRequests[slot] = c->request;
+    heldFields[slot] = c->fields;
+    c->request = held;
+    ESP_BARRIER();
+    heldHead++;
+  } else if (c->complete) {
+#if ESP_METRICS
+    countFailure(FAIL_OVERFLOW);
+#endif
+    if (serialYes) {
+      Serial.println("WARNING: dropping client request, none were released");
+    }
   }
+  c->complete = false;
+  c->state = CLIENT_IDLE;
 }
 
-//finds the page to serve and sends the length of the page as a CIPSEND parameter
-void ESP8266::findPage(){
-  //check if the requested path has an assigned page
-  String s= (char *)requestAP_p->path;
-  if(pageExists(s) == false){
-    //if not set the page to the default
-    s = "default";
-    stringToVolatileArray(s, requestAP_p->path, PATHSIZE);
+// FNV-1a hash of a page path
+uint32_t ESP8266::hashPath(const char *path, size_t len){
+  uint32_t h = 2166136261UL;
+  for(size_t i = 0; i < len; i++){
+    h = (h ^ (uint8_t)path[i]) * 16777619UL;
   }
+  return h;
+}
 
-  String h = getPage(s);
+// Returns the route of the page with the given path, or -1 if there's none.
+// The index is never full, so probing always reaches an empty slot.
+int ESP8266::findRoute(const char *path, size_t len){
+  volatile Pages *p = storedPages;
+  uint32_t h = hashPath(path, len);
+  for(uint32_t slot = h; ; slot++){
+    int r = p->index[slot & (ROUTEINDEXSIZE-1)] - 1;
+    if (r < 0){
+      return -1;
+    }
+    volatile Route *route = &p->routes[r];
+    if (route->hash == h && route->pathLen == len
+        && memcmp((char *)p->arena + route->offset, path, len) == 0){
+      return r;
+    }
+  }
+}
 
-  //count the length of the html
-  char c = ' ';
-  int len = 0;
-  while (c!='\0'){
-    c = h[len];
-    len++;
+// Looks up the page for a client's path, falling back to the default page
+// (which init() stored first)
+void ESP8266::findPage(int id){
+  Client *c = &clients[id];
+  c->route = findRoute(c->request + c->fields.path.at, c->fields.path.len);
+  if(c->route < 0){
+    c->route = 0;
   }
-  len--;
-  wifiSerial.print(",");
-  wifiSerial.println(len);
-  return;
+  c->sent = 0;
+  c->version = storedPages->routes[c->route].version;
 }
 
-//gets the html for the given directory
-String ESP8266::getPage(String dir){
-  for(int i = 0; i < NUMBEROFPAGES; i++){
-    String cmp = (char *)(storedPages->directory+i*PAGESIZE);
-    if(cmp == dir){
-      return (char *)(storedPages->html+i*HTMLSTORAGE);
+// Copies the next part of a client's page, up to APSENDSIZE bytes, into
+// sendBuffer and returns its length.  Copying keeps what goes out matching
+// the CIPSEND length even if setPage() runs before the prompt.  A handler
+// page's head is copied the same way, then the handler fills the rest,
+// told how much of its html it has made for this client so far.  Returns
+// -1 if the page was replaced after its first part went out.
+int ESP8266::nextChunk(int id){
+  Client *c = &clients[id];
+  volatile Route *route = &storedPages->routes[c->route];
+  if (route->version != c->version) {
+    if (c->sent > 0) {
+      return -1;
     }
+    c->version = route->version;
   }
-  if(serialYes){
-    Serial.println("There was an error getting the page requested.");
+  int len = 0;
+  if (c->sent < route->responseLen) {
+    len = route->responseLen - c->sent;
+    if (len > APSENDSIZE) {
+      len = APSENDSIZE;
+    }
+    memcpy(storage.ap.sendBuffer, (char *)storedPages->arena + route->offset
+        + route->pathLen + c->sent, len);
+  }
+  c->lastChunk = c->sent + len >= route->responseLen;
+  PageHandler handler = route->handler;
+  if (handler != NULL && c->lastChunk) {
+    c->lastChunk = false;
+    while (len < APSENDSIZE) {
+      int made = handler(spanText(c->request, c->fields.query),
+          c->sent + len - route->responseLen, storage.ap.sendBuffer + len,
+          APSENDSIZE - len);
+      if (made <= 0) {
+        c->lastChunk = true;
+        break;
+      }
+      len += made > APSENDSIZE - len ? APSENDSIZE - len : made;
+    }
   }
-  return (char *)storedPages->html;
+  return len;
 }
 
-//serves the page requested
+//sends the part of the page nextChunk() copied
 void ESP8266::servePage(){
-  String s = (char *)requestAP_p->path;
-  String h = getPage(s);
-  //String html = "<html>\n<title>It works!</title>\n<body>\n<h1>Congrats</h1>\n<p>You have successfully interneted.</p>\n</body>\n</html>";
-  wifiSerial.println(h);
+  ESP_STACK_MARK();
+  wifiSerial.write((const uint8_t *)storage.ap.sendBuffer, sendLen);
 }
 
-// Parses the response and stores the path and data into requestAP_p struct
-void ESP8266::requestParse(String resp){
-  String pathtmp;
-  String datatmp;
-    char res[512];
-    resp.toCharArray(res, 512);
-    char* ptr = res;
-    while(*ptr != ' '){
-        ptr++;
+// Tokenizes the head of a client's request in place: the method, path,
+// query, Host, Content-Type and Content-Length are found by position, and
+// the char after each is overwritten with a NUL so it can be used as text.
+// Nothing is copied.
+void ESP8266::requestParse(int id){
+    ESP_STACK_MARK();
+    Client *c = &clients[id];
+    char *text = c->request;
+    RequestSpans *f = &c->fields;
+    uint16_t end = c->rxLen;
+    uint16_t i = 0;
+    Span none = {0, 0};
+    f->method = f->path = f->query = none;
+    f->host = f->contentType = none;
+    f->contentLength = 0;
+
+    // Request line: METHOD SP path[?query] SP version CRLF
+    f->method.at = i;
+    while (i < end && text[i] != ' ' && text[i] != '\r') {
+      i++;
+    }
+    f->method.len = i - f->method.at;
+    if (i < end && text[i] == ' ') {
+      text[i++] = '\0';
+      f->path.at = i;
+      while (i < end && text[i] != ' ' && text[i] != '?' && text[i] != '\r') {
+        i++;
       }
-      ptr++;
-    while(*ptr != '?' && *ptr != ' '){
-      pathtmp += *ptr;
-      ptr++;
+      f->path.len = i - f->path.at;
+      if (i < end && text[i] == '?') {
+        text[i++] = '\0';
+        f->query.at = i;
+        while (i < end && text[i] != ' ' && text[i] != '\r') {
+          i++;
+        }
+        f->query.len = i - f->query.at;
       }
-    while(*ptr != ' '){
-      datatmp += *ptr;
-      ptr++;
     }
-
-    stringToVolatileArray(pathtmp, requestAP_p->path, PATHSIZE);
-
-    if (datatmp != "\0"){
-      stringToVolatileArray(datatmp, requestAP_p->data, DATASIZE);
+    // Headers, "Name: value" CRLF, until the blank line
+    while (i < end) {
+      while (i < end && text[i] != '\n') {
+        if (text[i] == ' ' || text[i] == '\r') {
+          text[i] = '\0';
+        }
+        i++;
+      }
+      uint16_t name = ++i;
+      if (i >= end || text[i] == '\r') {
+        break;
+      }
+      while (i < end && text[i] != ':' && text[i] != '\r') {
+        i++;
+      }
+      if (i >= end || text[i] != ':') {
+        continue;
+      }
+      text[i++] = '\0';
+      while (i < end && text[i] == ' ') {
+        i++;
+      }
+      Span value = {i, 0};
+      while (i < end && text[i] != '\r') {
+        i++;
+      }
+      value.len = i - value.at;
+      if (i < end) {
+        text[i] = '\0';
+      }
+      if (strcasecmp(text + name, "Host") == 0) {
+        f->host = value;
+      } else if (strcasecmp(text + name, "Content-Type") == 0) {
+        f->contentType = value;
+      } else if (strcasecmp(text + name, "Content-Length") == 0) {
+        f->contentLength = strtoul(text + value.at, NULL, 10);
+      }
     }
+
     if(serialYes){
       Serial.println();
+      Serial.print("linkID: ");
+      Serial.println(id);
       Serial.print("Path: ");
-      Serial.println((char *)requestAP_p->path);
+      Serial.println(spanText(text, f->path));
       Serial.print("Data: ");
-      if (datatmp == "\0"){
+      if (f->query.len == 0){
         Serial.println("No Data");
       }
       else{
-        Serial.println((char *)requestAP_p->data);
+        Serial.println(spanText(text, f->query));
       }
     }
-    dataReady = true;
 }
 
+// A span's text in a request, or "" if the part wasn't there
+const char *ESP8266::spanText(const char *text, Span span){
+  return span.len > 0 ? text + span.at : "";
+}
+#endif
+
 // Returns true if and only if target is in inputBuffer
-bool ESP8266::isTargetInResp(const char *target) {
+bool ESP8266::isTargetInResp(Token target) {
   loadRx();
-  return (strstr((char *)inputBuffer, target) != NULL);
+  return (control.seen & (1UL << target)) != 0;
 }
 
 // Looks for target in inputBuffer.  If target is found, loads all
 // preceding characters (including the target itself) into result array and
 // returns true, otherwise returns false.
-bool ESP8266::getStringFromResp(const char *target, char *result) {
-  loadRx();
-  char *loc = strstr((char *)inputBuffer, target);
-  if (loc != NULL) {
-    int numChars = loc - inputBuffer + strlen(target);
-    strncpy(result, (char *)inputBuffer, numChars);
+bool ESP8266::getStringFromResp(Token target, char *result) {
+  if (isTargetInResp(target)) {
+    int numChars = control.pos[target] + tokenLen[target];
+    memcpy(result, (char *)inputBuffer, numChars);
     result[numChars] = '\0'; //Make sure we null terminate the result
     return true;
   } else {
@@ -1378,13 +2853,12 @@ bool ESP8266::getStringFromResp(const char *target, char *result) {
 // the start target is before the end target, this method loads the characters
 // in between (including both targets) into result array and returns true.
 // Otherwise, returns false.
-bool ESP8266::getStringFromResp(const char*startTarget, const char*endTarget, char *result) {
-  loadRx();
-  char *startLoc = strstr((char *)inputBuffer, startTarget);
-  char *endLoc = strstr((char *)inputBuffer, endTarget);
-  if (startLoc != NULL && endLoc != NULL && startLoc < endLoc) {
-    int numChars = endLoc - startLoc + strlen(endTarget);
-    strncpy(result, startLoc, numChars);
+bool ESP8266::getStringFromResp(Token startTarget, Token endTarget, char *result) {
+  if (isTargetInResp(startTarget) && isTargetInResp(endTarget)
+      && control.pos[startTarget] < control.pos[endTarget]) {
+    int numChars = control.pos[endTarget] + tokenLen[endTarget]
+      - control.pos[startTarget];
+    memcpy(result, (char *)inputBuffer + control.pos[startTarget], numChars);
     result[numChars] = '\0';  //Make sure we null terminate the result
     return true;
   } else {
@@ -1413,14 +2887,10 @@ bool ESP8266::getStringFromResp(const char*startTarget, const char*endTarget, ch
 // Looks for a valid response to CIPSTATUS and returns the integer status
 // If an integer status can't be parsed from result, returns -1
 int ESP8266::getStatusFromResp() {
-  loadRx();
-  char result[BUFFERSIZE] = {0};
-  bool success = getStringFromResp(OK, result);
-  if (success) {
-    char *loc = strstr((char *)inputBuffer, STATUS); //Find "STATUS:"
-    if (loc != NULL) {
-      loc += strlen(STATUS);
-      char c = loc[0]; //If next character is digit, return that number
+  if (isTargetInResp(OK_TOK) && isTargetInResp(STATUS_TOK)) {
+    int loc = control.pos[STATUS_TOK] + tokenLen[STATUS_TOK];
+    if (loc < bufferLen) {
+      char c = inputBuffer[loc]; //If next character is digit, return that number
       if (c >= '0' && c <= '9') {
         return c - '0';
       }
@@ -1429,26 +2899,529 @@ int ESP8266::getStatusFromResp() {
   return -1; //Could not find valid status int in inputBuffer
 }
 
-// Load wifi serial buffer into character array (inputBuffer)
+// Load wifi serial buffer into character array (inputBuffer), feeding each
+// new character through the token matcher.  Cost depends only on the number
+// of new characters, not on how much is already buffered.
+// "+IPD,<id>,<len>:" frames are taken out of the stream and their payload
+// goes to the link (or access point client), so inputBuffer only holds AT
+// command output.  Frame headers and "<id>,CLOSED" are found by a matcher
+// of their own, which clearing inputBuffer doesn't reset.  The serial
+// buffer is always drained: when inputBuffer fills up, its oldest half is
+// dropped to make room.
 void ESP8266::loadRx() {
-  int buffIndex = strlen((char *)inputBuffer);
-  while (wifiSerial.available() > 0 && buffIndex < BUFFERSIZE-1) {
-      char c = wifiSerial.read();
-      if (serialYes) {
-        Serial.print(c);
+  ESP_STACK_MARK();
+  while (wifiSerial.available() > 0) {
+    char c = wifiSerial.read();
+    rxSeen = true;
+#if ESP_PROFILE
+    profileRx++;
+#endif
+    if (serialYes) {
+      Serial.print(c);
+    }
+    if (frameState == FRAME_PAYLOAD) {
+#if ESP_STATION
+      if (ESPmode == 0) {
+        linkReceive(frameLink, c);
+      }
+#endif
+#if ESP_AP
+      if (ESPmode == 1) {
+        clientReceive(frameLink, c);
+      }
+#endif
+      if (--frameRemaining == 0) {
+        frameState = FRAME_NONE;
+      }
+    } else if (frameState != FRAME_NONE) { // In the header
+      if (c >= '0' && c <= '9') {
+        frameValue = frameValue*10 + (c - '0');
+      } else if (c == ',' && frameState == FRAME_LINK) {
+        frameLink = frameValue;
+        frameValue = 0;
+        frameState = FRAME_LENGTH;
+      } else if (c == ':' && frameState == FRAME_LENGTH && frameValue > 0) {
+        frameRemaining = frameValue;
+        frameState = FRAME_PAYLOAD;
+      } else {
+        frameState = FRAME_NONE; // Not a frame header after all
+      }
+    } else {
+      noticeNode = matcherStep(noticeNode, c);
+      if (c == ',' && noticePrev >= '0' && noticePrev <= '9') {
+        noticeLink = noticePrev - '0';
+        noticeGap = 0;
+      } else if (noticeGap < 255) {
+        noticeGap++;
       }
-      inputBuffer[buffIndex] = c;
-      inputBuffer[buffIndex+1] = '\0';
-      buffIndex++;
+      noticePrev = c;
+      uint32_t notices = matcher[noticeNode].out
+        & ((1UL << IPD_FRAME_TOK) | (1UL << CLOSED_TOK));
+      if (bufferLen >= BUFFERSIZE-1) {
+#if ESP_METRICS
+        countFailure(FAIL_OVERFLOW);
+#endif
+        if (serialYes) {
+          Serial.println("WARNING: inputBuffer is full");
+        }
+        dropBuffer(bufferLen - BUFFERSIZE/2);
+      }
+      int index = bufferLen++;
+      inputBuffer[index] = c;
+      matchChar(&control, c, index);
+      if (notices) {
+        linkEvent(notices, index);
+      }
+    }
   }
-  if (buffIndex >= BUFFERSIZE -1) {
-    if (serialYes) {
-      Serial.println("WARNING: inputBuffer is full");
+  inputBuffer[bufferLen] = '\0';
+}
+
+// Per-state row the ISR is in now: the command channel's state, or the
+// last row while a startup script runs
+int ESP8266::stateRow() {
+  return scriptRunning >= 0 ? STATEROWS - 1
+    : ESPmode == 0 ? (int)state : (int)stateAP;
+}
+
+#if ESP_METRICS
+// Counts a failure in the given per-state row
+void ESP8266::countFailure(FailureCause cause, int row) {
+  metricsSeq++;
+  ESP_BARRIER();
+  if (metricsClear) {
+    memset(&metricsData, 0, sizeof(metricsData));
+    metricsClear = false;
+  }
+  metricsData.counts[cause][row]++;
+  ESP_BARRIER();
+  metricsSeq++;
+}
+
+// Counts a failure in the state the ISR is in now
+void ESP8266::countFailure(FailureCause cause) {
+  countFailure(cause, stateRow());
+}
+#endif
+
+// Where the FSMs are, packed so adaptTick() can tell if a tick moved them
+uint32_t ESP8266::tickState() {
+  return (ESPmode == 0 ? (uint32_t)state : (uint32_t)stateAP)
+    | (uint32_t)(uint8_t)scriptRunning << 8 | (uint32_t)scriptStep << 16
+    | (uint32_t)stepSent << 24;
+}
+
+// Sets the timer for the next tick.  A tick that read anything, moved an
+// FSM, or followed a wakeTick() keeps the full rate; after TICK_IDLE_STEPS
+// quiet ticks in a row the period doubles, up to TICK_IDLE_MICROS.  Timeouts
+// are kept in millis(), so they still run out on time, just checked less
+// often.
+void ESP8266::adaptTick(uint32_t before) {
+  bool active = rxSeen || tickWake || tickState() != before;
+  rxSeen = false;
+  if (!adaptiveTick) {
+    return;
+  }
+  unsigned long fast = ESPmode == 0 ? INTERRUPT_MICROS : INTERRUPT_MICROS_AP;
+  unsigned long period = tickMicros;
+  if (active) {
+    tickWake = false;
+    quietTicks = 0;
+    period = fast;
+  } else if (++quietTicks >= TICK_IDLE_STEPS) {
+    quietTicks = 0;
+    period = period * 2 > TICK_IDLE_MICROS ? TICK_IDLE_MICROS : period * 2;
+  }
+  if (period != tickMicros) {
+    tickMicros = period;
+#if !ESP_EXTERNAL_TICK
+    timer.update(period);
+#endif
+  }
+}
+
+#if ESP_PROFILE
+// Notes the time and the state an ISR run starts in.  Script ticks go in
+// the last row, whatever the state.
+void ESP8266::profileBegin() {
+  profileStart = ESP_CYCLES();
+  profileRx = 0;
+  profileRow = stateRow();
+}
+
+// Adds the ISR run that profileBegin() started to its state's row and to
+// the histogram
+void ESP8266::profileEnd() {
+  uint32_t cycles = ESP_CYCLES() - profileStart;
+  profileSeq++;
+  ESP_BARRIER();
+  if (profileClear) {
+    memset(profileData.states, 0, sizeof(profileData.states));
+    memset(profileData.histogram, 0, sizeof(profileData.histogram));
+    profileClear = false;
+  }
+  StateProfile *row = &profileData.states[profileRow];
+  row->ticks++;
+  row->totalCycles += cycles;
+  if (cycles > row->maxCycles) {
+    row->maxCycles = cycles;
+  }
+  row->rxBytes += profileRx;
+  uint32_t micros = cycles / profileData.cyclesPerMicro;
+  int bucket = 0;
+  while (micros > 0 && bucket < PROFILEBUCKETS - 1) {
+    micros >>= 1;
+    bucket++;
+  }
+  profileData.histogram[bucket]++;
+  ESP_BARRIER();
+  profileSeq++;
+}
+#endif
+
+// Drops the first n chars of inputBuffer.  Tokens found in what is left
+// keep their positions relative to the text; the rest are forgotten.
+void ESP8266::dropBuffer(int n) {
+  memmove((char *)inputBuffer, (char *)inputBuffer + n, bufferLen - n);
+  bufferLen -= n;
+  for (int t = 0; t < NUMBEROFTOKENS; t++) {
+    if (control.seen & (1UL << t)) {
+      if (control.pos[t] >= n) {
+        control.pos[t] -= n;
+      } else {
+        control.seen &= ~(1UL << t);
+      }
     }
   }
 }
 
+// Cuts inputBuffer back to len chars, forgetting tokens found past that
+void ESP8266::truncateBuffer(int len) {
+  bufferLen = len;
+  for (int t = 0; t < NUMBEROFTOKENS; t++) {
+    if ((control.seen & (1UL << t)) && control.pos[t] + tokenLen[t] > len) {
+      control.seen &= ~(1UL << t);
+    }
+  }
+  control.node = 0;
+}
+
+// Handles link notices in the modem's output, where index is the position of
+// the last char of the token in inputBuffer.  Its start may be gone, if
+// inputBuffer was cleared since.
+void ESP8266::linkEvent(uint32_t tokens, int index) {
+  if (tokens & (1UL << IPD_FRAME_TOK)) {
+    frameState = FRAME_LINK;
+    frameValue = 0;
+    noticeNode = 0;
+    int start = index + 1 - tokenLen[IPD_FRAME_TOK];
+    truncateBuffer(start > 0 ? start : 0); // Not command output
+    return;
+  }
+  if (tokens & (1UL << CLOSED_TOK)) { // "<id>,CLOSED"
+    if (noticeGap == tokenLen[CLOSED_TOK]) { // Right after the ","
+      int id = noticeLink;
+#if ESP_STATION
+      if (ESPmode == 0 && id >= 0 && id < STATIONLINKS) {
+        links[id].closed = true;
+      }
+#endif
+#if ESP_AP
+      // A client being served finds out from its CIPSEND failing
+      if (ESPmode == 1 && id >= 0 && id < APLINKS && id != activeClient) {
+#if ESP_METRICS
+        if (clients[id].state == CLIENT_RECEIVING
+            || clients[id].state == CLIENT_SERVING) {
+          countFailure(FAIL_CLOSED);
+        }
+#endif
+        endClient(id);
+      }
+#endif
+    }
+  }
+}
+
+#if ESP_STATION
+
+// Feeds one payload byte of a link to its HTTP response parser.  Only the
+// body is kept, with any chunked encoding taken off.  Line-based parts
+// (status line, headers, chunk sizes, trailers) are collected in http.line,
+// cut to HTTPLINESIZE, and handled at their end.
+void ESP8266::linkReceive(int id, char c) {
+  if (id < 0 || id >= STATIONLINKS) {
+    return;
+  }
+  Link *l = &links[id];
+  HttpParser *p = &l->http;
+#if ESP_TIMING
+  if (l->rxTotal == 0 && l->request != NULL) {
+    l->request->timing.firstByte = micros();
+  }
+#endif
+  l->rxTotal++;
+  l->rxTime = millis(); // A response can take any time while it keeps coming
+  switch (p->phase) {
+    case HTTP_STATUS_LINE:
+      if (p->lineLen < 5 && c != "HTTP/"[p->lineLen]) {
+        // Not HTTP: the whole reply is the body, up to the server closing
+        for (int i = 0; i < p->lineLen; i++) {
+          storeBody(l, p->line[i]);
+        }
+        storeBody(l, c);
+        p->close = true;
+        p->remaining = -1;
+        p->phase = HTTP_BODY;
+        return;
+      }
+      break;
+    case HTTP_BODY:
+      storeBody(l, c);
+      if (p->remaining > 0 && --p->remaining == 0) {
+        p->phase = HTTP_DONE;
+      }
+      return;
+    case HTTP_CHUNK_DATA:
+      storeBody(l, c);
+      if (--p->remaining == 0) {
+        p->phase = HTTP_CHUNK_CRLF;
+      }
+      return;
+    case HTTP_CHUNK_CRLF:
+      if (c == '\n') {
+        p->phase = HTTP_CHUNK_SIZE;
+      }
+      return;
+    case HTTP_DONE:
+      return; // Nothing should follow
+    default:
+      break;
+  }
+  if (c == '\r') {
+    return;
+  }
+  if (c != '\n') {
+    if (p->lineLen < HTTPLINESIZE-1) {
+      p->line[p->lineLen++] = c;
+    }
+    return;
+  }
+  p->line[p->lineLen] = '\0';
+  httpLine(p);
+  p->lineLen = 0;
+}
+
+// Handles a complete line of a response's head, or a chunk size or trailer
+void ESP8266::httpLine(HttpParser *p) {
+  ESP_STACK_MARK();
+  char *line = p->line;
+  switch (p->phase) {
+    case HTTP_STATUS_LINE: // "HTTP/1.1 200 OK"
+      {
+      char *code = strchr(line, ' ');
+      p->status = code != NULL ? atoi(code + 1) : 0;
+      p->close = strncmp(line, "HTTP/1.0", 8) == 0;
+      p->chunked = false;
+      p->remaining = -1;
+      p->phase = HTTP_HEADER;
+      }
+      break;
+    case HTTP_HEADER:
+      if (line[0] != '\0') {
+        if (strncasecmp(line, "Content-Length:", 15) == 0) {
+          p->remaining = atol(line + 15);
+        } else if (strncasecmp(line, "Transfer-Encoding:", 18) == 0) {
+          p->chunked = strstr(line + 18, "chunked") != NULL;
+        } else if (strncasecmp(line, "Connection:", 11) == 0) {
+          p->close = strstr(line + 11, "close") != NULL;
+        }
+      } else if (p->status >= 100 && p->status < 200) {
+        p->phase = HTTP_STATUS_LINE; // Interim response, the real one follows
+      } else if (p->status == 204 || p->status == 304 || p->remaining == 0) {
+        p->phase = HTTP_DONE; // No body
+      } else if (p->chunked) {
+        p->phase = HTTP_CHUNK_SIZE;
+      } else {
+        if (p->remaining < 0) {
+          p->close = true; // Body ends when the server closes
+        }
+        p->phase = HTTP_BODY;
+      }
+      break;
+    case HTTP_CHUNK_SIZE: // Hex size, maybe followed by ";extension"
+      p->remaining = strtol(line, NULL, 16);
+      p->phase = p->remaining > 0 ? HTTP_CHUNK_DATA : HTTP_TRAILER;
+      break;
+    case HTTP_TRAILER:
+      if (line[0] == '\0') {
+        p->phase = HTTP_DONE;
+      }
+      break;
+    default:
+      break;
+  }
+}
+
+// Appends a body byte to the link's response slot, if there's room, or to
+// the stream if the request is streamed
+void ESP8266::storeBody(Link *l, char c) {
+  ESP_STACK_MARK();
+#if ESP_STREAMING
+  if (l->request != NULL && l->request->stream) {
+    if ((uint16_t)(streamHead - streamTail) >= STREAMSIZE) {
+#if ESP_METRICS
+      if (!streamFailed) {
+        countFailure(FAIL_OVERFLOW, AWAITRESPONSE);
+      }
+#endif
+      streamFailed = true; // Not read in time, the byte is lost
+      return;
+    }
+    streamBuffer[streamHead & (STREAMSIZE-1)] = c;
+    ESP_BARRIER();
+    streamHead++;
+    return;
+  }
+#endif
+  if (l->slot < 0 || l->rxLen >= RESPONSESIZE-1) {
+#if ESP_METRICS
+    if (l->slot >= 0 && !l->overflowed) {
+      countFailure(FAIL_OVERFLOW, AWAITRESPONSE);
+    }
+#endif
+    l->overflowed = true;
+    return; // Nobody wants it, or the response slot is full
+  }
+  char *r = (char *)response[l->slot];
+  r[l->rxLen++] = c;
+  r[l->rxLen] = '\0';
+}
+
+// Readies a link to receive a new response
+void ESP8266::resetReceive(int id) {
+  Link *l = &links[id];
+  l->rxLen = 0;
+  l->rxTotal = 0;
+  l->overflowed = false;
+  l->http.phase = HTTP_STATUS_LINE;
+  l->http.lineLen = 0;
+  l->http.status = 0;
+  l->http.remaining = -1;
+  l->http.chunked = false;
+  l->http.close = false;
+}
+#endif
+
+// Advances m by c, the char at index in m's buffer, and records where each
+// new token first appeared.  Returns every token ending at c.
+uint32_t ESP8266::matchChar(MatchState *m, char c, int index) {
+  m->node = matcherStep(m->node, c);
+  uint32_t out = matcher[m->node].out;
+  uint32_t found = out & ~m->seen;
+  if (found) {
+    for (int t = 0; t < NUMBEROFTOKENS; t++) {
+      if (found & (1UL << t)) {
+        m->pos[t] = index + 1 - tokenLen[t];
+      }
+    }
+    m->seen |= found;
+  }
+  return out;
+}
+
+void ESP8266::resetMatch(MatchState *m) {
+  m->node = 0;
+  m->seen = 0;
+}
+
 void ESP8266::emptyRxAndBuffer() {
   emptyRx();
   inputBuffer[0] = '\0';
+  bufferLen = 0;
+  resetMatch(&control);
+  frameState = FRAME_NONE;
+  noticeNode = 0;
+  noticePrev = '\0';
+  noticeGap = 255;
+}
+
+// ISR version of emptyRxAndBuffer().  Link data can't be thrown away, so this
+// reads everything waiting first and then clears the AT command output.
+void ESP8266::clearBuffer() {
+  loadRx();
+  inputBuffer[0] = '\0';
+  bufferLen = 0;
+  resetMatch(&control);
+}
+
+// Builds the Aho-Corasick automaton over TOKENS[].  Node 0 is the root, so a
+// child index of 0 means "no child".  Only runs once.
+void ESP8266::buildMatcher() {
+  if (matcherSize > 0) {
+    return;
+  }
+  matcher[0].c = '\0';
+  matcher[0].child = 0;
+  matcher[0].sibling = 0;
+  matcher[0].fail = 0;
+  matcher[0].out = 0;
+  matcherSize = 1;
+  // Insert each token into the trie
+  for (int t = 0; t < NUMBEROFTOKENS; t++) {
+    uint8_t node = 0;
+    tokenLen[t] = strlen(TOKENS[t]);
+    for (const char *p = TOKENS[t]; *p != '\0'; p++) {
+      uint8_t next = matcherChild(node, *p);
+      if (next == 0) {
+        if (matcherSize >= MATCHERNODES) {
+          return; // MATCHERNODES is too small for TOKENS[]
+        }
+        next = matcherSize++;
+        matcher[next].c = *p;
+        matcher[next].child = 0;
+        matcher[next].sibling = matcher[node].child;
+        matcher[next].fail = 0;
+        matcher[next].out = 0;
+        matcher[node].child = next;
+      }
+      node = next;
+    }
+    matcher[node].out |= 1UL << t;
+  }
+  // Breadth-first pass to set failure links and merge suffix outputs
+  uint8_t queue[MATCHERNODES];
+  int head = 0;
+  int tail = 0;
+  for (uint8_t n = matcher[0].child; n != 0; n = matcher[n].sibling) {
+    queue[tail++] = n;
+  }
+  while (head < tail) {
+    uint8_t r = queue[head++];
+    for (uint8_t s = matcher[r].child; s != 0; s = matcher[s].sibling) {
+      queue[tail++] = s;
+      matcher[s].fail = matcherStep(matcher[r].fail, matcher[s].c);
+      matcher[s].out |= matcher[matcher[s].fail].out;
+    }
+  }
+}
+
+// Returns the child of node reached on c, or 0 if there is none
+uint8_t ESP8266::matcherChild(uint8_t node, char c) {
+  for (uint8_t n = matcher[node].child; n != 0; n = matcher[n].sibling) {
+    if (matcher[n].c == c) {
+      return n;
+    }
+  }
+  return 0;
+}
+
+// Advances the matcher by one character, following failure links as needed
+uint8_t ESP8266::matcherStep(uint8_t node, char c) {
+  while (true) {
+    uint8_t next = matcherChild(node, c);
+    if (next != 0 || node == 0) {
+      return next;
+    }
+    node = matcher[node].fail;
+  }
 }
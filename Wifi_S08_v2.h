@@ -11,27 +11,180 @@
 #define Wifi_S08_v2_H
 
 #define ESP_VERSION "2.1"
-#define wifiSerial Serial1
+#ifndef ESP_SERIAL
+#define ESP_SERIAL Serial1 // Port the ESP8266 is wired to
+#endif
+#define wifiSerial ESP_SERIAL
 
 #define GET 0
 #define POST 1
 
-// Sizes of character arrays
-#define BUFFERSIZE 4096
-#define RESPONSESIZE 4096
+// Build configuration.  Each setting below can be overridden without editing
+// the library by defining it in the build flags, e.g. -DRESPONSESIZE=1024.
+// It must be the same for the library and the sketch.
+
+// Subsystems, 1 to build in or 0 to leave out
+#ifndef ESP_STATION
+#define ESP_STATION 1 // Station mode: requests to web servers
+#endif
+#ifndef ESP_AP
+#define ESP_AP 1 // Access point mode: serving pages set with setPage()
+#endif
+#ifndef ESP_UPLOADS
+#define ESP_UPLOADS 1 // sendBigRequest() and sendUploadRequest()
+#endif
+#ifndef ESP_STREAMING
+#define ESP_STREAMING 1 // sendStreamRequest() and readStream()
+#endif
+#ifndef ESP_EXTERNAL_TICK
+#define ESP_EXTERNAL_TICK 0 // 1: no IntervalTimer, the sketch calls tick()
+#endif
+#ifndef ESP_METRICS
+#define ESP_METRICS 1 // Failure and retry counters, see getMetrics()
+#endif
+#ifndef ESP_PROFILE
+#define ESP_PROFILE 0 // Per-state ISR timing, see getProfile()
+#endif
+#ifndef ESP_TIMING
+#define ESP_TIMING 1 // Request phase timing, see getTimingStats()
+#endif
+
+#if !ESP_STATION && !ESP_AP
+#error "ESP_STATION and ESP_AP can't both be 0"
+#endif
+#if !ESP_STATION
+#undef ESP_UPLOADS
+#define ESP_UPLOADS 0
+#undef ESP_STREAMING
+#define ESP_STREAMING 0
+#undef ESP_TIMING
+#define ESP_TIMING 0
+#endif
+
+// The switches change the class layout, so a sketch built with other ones
+// than the library must not link: every file that includes this header
+// refers to a symbol named after them, which only the library defines.
+// The sizes are checked at the end of this file.
+#define ESP_CONFIG_CAT(a, b, c, d, e, f, g, h) \
+  espConfig_##a##b##c##d##e##f##g##h
+#define ESP_CONFIG_NAME(a, b, c, d, e, f, g, h) \
+  ESP_CONFIG_CAT(a, b, c, d, e, f, g, h)
+#define ESP_CONFIG ESP_CONFIG_NAME(ESP_STATION, ESP_AP, ESP_UPLOADS, \
+  ESP_STREAMING, ESP_EXTERNAL_TICK, ESP_METRICS, ESP_PROFILE, ESP_TIMING)
+extern const char ESP_CONFIG;
+static const char * const espConfigCheck __attribute__((used)) = &ESP_CONFIG;
+
+// Sizes of character arrays.  The defaults keep the driver under the RAM
+// it used before it could queue requests, hold several connections or
+// serve several clients; raise them for that.
+#ifndef BUFFERSIZE
+#define BUFFERSIZE 1024 // AT command output; payloads go to links and clients
+#endif
+#ifndef RESPONSESIZE
+#define RESPONSESIZE 4096 // Response body, per queued response
+#endif
 #define MACSIZE 17
 #define SSIDSIZE 32
 #define PASSWORDSIZE 64
+#ifndef DOMAINSIZE
 #define DOMAINSIZE 256
+#endif
+#ifndef PATHSIZE
 #define PATHSIZE 256
-#define DATASIZE 2048
-#define NUMBEROFPAGES 8
-#define PAGESIZE 64
-#define HTMLSTORAGE 1024
+#endif
+#ifndef DATASIZE
+#define DATASIZE 2048 // Request data, and the most sent per CIPSEND
+#endif
+#define CIPSEND_MAX 2048 // Most bytes the modem takes in one AT+CIPSEND
+#ifndef NUMBEROFPAGES
+#define NUMBEROFPAGES 8 // Most pages setPage() can store
+#endif
+#ifndef PAGESIZE
+#define PAGESIZE 64 // Longest page path
+#endif
+#ifndef PAGESTORAGE
+#define PAGESTORAGE 3072 // Paths and html of every page together
+#endif
+#ifndef APREQUESTSIZE
+#define APREQUESTSIZE 512 // Head of a client's request kept, per client
+#endif
+#ifndef APSENDSIZE
+#define APSENDSIZE 1024 // Most of a page sent to a client per CIPSEND
+#endif
+#ifndef APHELDREQUESTS
+#define APHELDREQUESTS 1 // Finished client requests kept for getRequest()
+#endif
+#define APLINKS 5 // Link IDs the ESP8266 gives access point clients
+#ifndef ROUTEINDEXSIZE
+#define ROUTEINDEXSIZE 16 // Must be a power of two, above NUMBEROFPAGES
+#endif
+#define MATCHERNODES 160
+#define STATEROWS 10 // Per-state rows: FSM states, then scripts
+#define PROFILEBUCKETS 12 // ISR durations: <1us, 1us, 2-3us, ... >=1024us
+#define TIMINGBUCKETS 56 // Phase durations, two per power of two up to 2^28us
+#ifndef REQUESTQUEUESIZE
+// Must be a power of two.  At 1 nothing queues: a submit while a request is
+// in flight is rejected
+#define REQUESTQUEUESIZE 1
+#endif
+#ifndef RESPONSEQUEUESIZE
+#define RESPONSEQUEUESIZE 1 // Must be a power of two
+#endif
+#ifndef STATIONLINKS
+#define STATIONLINKS 1 // Concurrent connections, the ESP8266 allows up to 5
+#endif
+#ifndef STREAMSIZE
+#define STREAMSIZE 1024 //Must be a power of 2
+#endif
+#ifndef HTTPLINESIZE
+#define HTTPLINESIZE 64 //Longest HTTP status/header line kept for parsing
+#endif
+
+#if (REQUESTQUEUESIZE & (REQUESTQUEUESIZE-1)) \
+  || (RESPONSEQUEUESIZE & (RESPONSEQUEUESIZE-1)) || (STREAMSIZE & (STREAMSIZE-1)) \
+  || (APHELDREQUESTS & (APHELDREQUESTS-1))
+#error "REQUESTQUEUESIZE, RESPONSEQUEUESIZE, STREAMSIZE and APHELDREQUESTS must be powers of two"
+#endif
+#if (ROUTEINDEXSIZE & (ROUTEINDEXSIZE-1)) || ROUTEINDEXSIZE <= NUMBEROFPAGES \
+  || NUMBEROFPAGES > 255 || PAGESIZE > 256 || PAGESTORAGE > 65535 \
+  || APREQUESTSIZE > 65535
+#error "Page settings out of range, see Wifi_S08_v2.h"
+#endif
+#if DATASIZE > CIPSEND_MAX || APSENDSIZE > CIPSEND_MAX
+#error "DATASIZE and APSENDSIZE can't be over CIPSEND_MAX, the most the ESP8266 sends at once"
+#endif
+#if ESP_UPLOADS && DATASIZE < 256
+#error "DATASIZE can't be under 256 with ESP_UPLOADS, an upload's head has to fit"
+#endif
+#if STATIONLINKS < 1 || STATIONLINKS > 5
+#error "STATIONLINKS must be 1 to 5"
+#endif
 
 // Timing constants
 #define INTERRUPT_MICROS 1000
 #define INTERRUPT_MICROS_AP 500
+// Slowest the adaptive tick goes (see setAdaptiveTick()).  Serial1's 64
+// byte receive buffer fills in about 5.5ms at 115200 baud, so keep this
+// under that unless the buffer has been made bigger.
+#ifndef TICK_IDLE_MICROS
+#define TICK_IDLE_MICROS 4000
+#endif
+#define TICK_IDLE_STEPS 8 // Quiet ticks at each speed before slowing down
+
+// Cycle counter for ESP_PROFILE: the Cortex-M DWT counter, unless the build
+// flags give another
+#ifndef ESP_CYCLES
+#define ESP_CYCLES() ARM_DWT_CYCCNT
+#endif
+#ifndef ESP_CYCLES_START
+#define ESP_CYCLES_START() do { \
+    ARM_DEMCR |= ARM_DEMCR_TRCENA; \
+    ARM_DWT_CTRL |= ARM_DWT_CTRL_CYCCNTENA; \
+  } while (0)
+#endif
+#ifndef ESP_CYCLES_PER_SEC
+#define ESP_CYCLES_PER_SEC F_CPU
+#endif
 #define AT_TIMEOUT 1000
 #define MAC_TIMEOUT 1000
 #define CWMODE_TIMEOUT 1000
@@ -41,18 +194,30 @@
 #define CONNCHECK_TIMEOUT 10000
 #define CIPSTATUS_TIMEOUT 5000
 #define CWJAP_TIMEOUT 15000
+// How long a station connection may take to open, and a server may go
+// without sending any of its response.  A request that fails waits the whole
+// time, so these set the latency tail; lower them for servers known to be
+// close and fast.
+#ifndef CIPSTART_TIMEOUT
 #define CIPSTART_TIMEOUT 15000
+#endif
+#ifndef HTTP_TIMEOUT
+#define HTTP_TIMEOUT 10000
+#endif
 #define CIPSEND_TIMEOUT 2000
 #define DATAOUT_TIMEOUT 5000
-#define HTTP_TIMEOUT 10000
 #define SENDRESPONSE_TIMEOUT 300
 #define CLOSE_TIMEOUT 100
+#define CIPCLOSE_TIMEOUT 1000
+#define KEEPALIVE_TIMEOUT 5000
+#define RETRY_DELAY 1000 // Wait before a failed request is tried again
 #define AWAITREQUEST_TIMEOUT 1000
 #define CWSAP_TIMEOUT 5000
 #define CIPMUX_TIMEOUT 5000
 #define CIPSERVER_TIMEOUT 5000
 #define CIPAP_TIMEOUT 5000
 #define CHECK_TIMEOUT 1000
+#define AT_TRIES 3 //Attempts at the first AT, while the ESP8266 boots
 
 // AT Commands, some of which require appended arguments
 #define AT_BASIC "AT"
@@ -63,11 +228,15 @@
 #define AT_CIPAPMAC "AT+CIPAPMAC?"
 #define AT_CIPSTATUS "AT+CIPSTATUS"
 #define AT_CWJAP "AT+CWJAP_DEF="
-#define AT_CIPSTART "AT+CIPSTART=\"TCP\","
-#define AT_CIPSTART_SSL "AT+CIPSTART=\"SSL\","
+#define AT_CIPSTART "AT+CIPSTART="
+#define CIPSTART_TCP ",\"TCP\","
+#define CIPSTART_SSL ",\"SSL\","
+#define AT_CWMODE_GET "AT+CWMODE_DEF?"
+#define AT_CIPMUX_GET "AT+CIPMUX?"
+#define AT_CIPCLOSE_ALL "AT+CIPCLOSE=5"
 #define AT_CIPSSLSIZE "AT+CIPSSLSIZE=4096"
-#define AT_CIPSEND "AT+CIPSENDEX="
-#define AT_CIPCLOSE "AT+CIPCLOSE"
+#define AT_CIPSEND "AT+CIPSEND="
+#define AT_CIPCLOSE "AT+CIPCLOSE="
 
 // AT Commands, for access point setup and operation
 #define AT_CWMODE_AP "AT+CWMODE_DEF=2"
@@ -84,7 +253,7 @@
 
 
 // default html page to display
-#define DEF_DIR "default,"
+#define DEF_DIR "default"
 #define DEF_HTML "<html>\n<title>Page Error</title>\n<body>\n<h1>Page not set</h1>\n<p>The page you requested was not found</p>\n</body>\n</html>"
 
 #define HTTP_POST "POST "
@@ -96,56 +265,249 @@
 #define HTTP_JSON "\r\nContent-Type:application/json"
 #define HTTP_END "\r\n\r\n"
 
-//macros for length of boilerplate part of GET and POST requests
-//-3 offset to ignore null terminators, +4 offset for "?" and ":" and \r\n
-#define HTTP_GET_FIXED_LEN sizeof(HTTP_GET)+sizeof(HTTP_0)+sizeof(HTTP_END)-3+2
-//-5 offset to ignore null terminators, +3 offset for ":", and /r/n
-#define HTTP_POST_FIXED_LEN sizeof(HTTP_POST)+sizeof(HTTP_0)+sizeof(HTTP_1)\
-  +sizeof(HTTP_2)+sizeof(HTTP_END)-5+3
-#define HTTP_POST_JSON_FIXED_LEN sizeof(HTTP_POST)+sizeof(HTTP_0)+sizeof(HTTP_1)\
-  +sizeof(HTTP_2)+sizeof(HTTP_END)-5+3
-#define HTTP_JSON_CHUNKED_FIXED_LEN sizeof(HTTP_POST)+sizeof(HTTP_0)+sizeof(HTTP_CHUNKED)\
-  +sizeof(HTTP_JSON)-4+3
+#define HTTP_CHUNK_END "0\r\n\r\n"
+
+// Head of the responses setPage() renders, followed by the html's length
+// and HTTP_END.  Handler pages have no length and end when the link closes.
+#define HTTP_PAGE_OK "HTTP/1.1 200 OK\r\n"
+#define HTTP_PAGE_NOT_FOUND "HTTP/1.1 404 Not Found\r\n"
+#define HTTP_PAGE_TYPE "Content-Type: text/html\r\nConnection: close\r\n"
+#define HTTP_PAGE_HEAD HTTP_PAGE_TYPE "Content-Length: "
+#define HTTP_PAGE_HEADSIZE 128 // Room for the whole head
+
+//macros for length of boilerplate part of GET and POST requests, which must
+//match what the CIPSEND state writes.  sizeof() counts each null terminator.
+//-3 offset to ignore null terminators, +2 offset for "?" and ":"
+#define HTTP_GET_FIXED_LEN (sizeof(HTTP_GET)+sizeof(HTTP_0)+sizeof(HTTP_END)-3+2)
+//-5 offset to ignore null terminators, +1 offset for ":"
+#define HTTP_POST_FIXED_LEN (sizeof(HTTP_POST)+sizeof(HTTP_0)+sizeof(HTTP_1)\
+  +sizeof(HTTP_2)+sizeof(HTTP_END)-5+1)
+//and of the head of an upload, which buildUpload() writes
+#define HTTP_UPLOAD_FIXED_LEN (sizeof(HTTP_POST)+sizeof(HTTP_0)\
+  +sizeof(HTTP_JSON)+sizeof(HTTP_CHUNKED)+sizeof(HTTP_END)-5+1)
+//room taken by a chunk besides its data: the hex size line (up to
+//CHUNKSIZELEN, enough for the 3 hex digits of a chunk under CIPSEND_MAX)
+//and the CRLF after the data
+#define CHUNKSIZELEN 6
+#define CHUNKOVERHEAD (CHUNKSIZELEN+2)
+
+//replies of startup probes showing a setting is already right
+#define CWMODE_STATION "+CWMODE_DEF:1"
+#define CWMODE_AP "+CWMODE_DEF:2"
+#define CIPMUX_ON "+CIPMUX:1"
 
 #include <WString.h>
 #include <Arduino.h>
 
+// Keeps the compiler from moving buffer writes past the index update that
+// hands the buffer over between user calls and the ISR
+#define ESP_BARRIER() __asm__ __volatile__("" ::: "memory")
+
 class ESP8266 {
   public:
+#if ESP_UPLOADS
+    // Producer of an upload's body, see sendUploadRequest()
+    typedef int (*UploadSource)(char *buf, int len);
+#endif
+#if ESP_AP
+    // Producer of a page's html, see setPageHandler()
+    typedef int (*PageHandler)(const char *query, unsigned long offset,
+        char *buf, int len);
+
+    // A part of a client's request, see getRequest().  text is in the
+    // driver's copy of the request and ends with a NUL; it's "" if the
+    // part wasn't there.
+    struct RequestField {
+      const char *text;
+      uint16_t len;
+    };
+    struct APRequest {
+      RequestField method; // "GET", "POST", ...
+      RequestField path; // Without the query
+      RequestField query; // After "?"
+      RequestField host; // Host header
+      RequestField contentType; // Content-Type header
+      RequestField body; // Up to Content-Length bytes
+      unsigned long contentLength; // 0 if there was no Content-Length
+      bool truncated; // Some of the head or body didn't fit
+    };
+#endif
+
+    // Where the driver's RAM goes, see memoryReport().  Sizes are in bytes.
+    struct MemoryReport {
+      size_t total; // The driver object, every buffer below included
+      size_t inputBuffer; // AT command output
+      size_t modeStorage; // Shared by station and access point mode
+      // Parts of modeStorage the running mode uses, 0 for the other mode's
+      size_t requests; // Request queue, or access point request buffers
+      size_t responses; // Station mode response slots
+      size_t pages; // Access point pages
+      size_t stream; // Station mode streamed response buffer
+      int heapBlocks; // Heap blocks owned by the driver
+      size_t isrStackPeak; // Deepest ISR stack use seen so far
+    };
+
+#if ESP_TIMING
+    // When a request reached each step, in micros().  Steps it didn't go
+    // through (connecting, on a kept-alive connection) are 0.
+    struct RequestTiming {
+      uint32_t queued; // Submitted
+      uint32_t started; // Got the command channel, CIPSTART or CIPSEND
+      uint32_t connected; // CIPSTART answered
+      uint32_t prompt; // First CIPSEND prompt
+      uint32_t sent; // Last SEND OK
+      uint32_t firstByte; // First byte of the response
+      uint32_t done; // Response complete
+    };
+    // Time between steps, see getTimingStats()
+    enum Phase {
+      PHASE_QUEUE, // queued to started
+      PHASE_CONNECT, // started to connected
+      PHASE_PROMPT, // connected (or started) to prompt
+      PHASE_SEND, // prompt to sent
+      PHASE_SERVER, // sent to firstByte
+      PHASE_RECEIVE, // firstByte to done
+      PHASE_TOTAL, // queued to done
+      NUMBEROFPHASES
+    };
+    struct PhaseStats {
+      uint32_t count; // Requests that went through the phase
+      uint32_t minMicros;
+      uint32_t avgMicros;
+      uint32_t p99Micros; // Upper bound, to within 50%
+      uint32_t maxMicros;
+    };
+    struct TimingStats {
+      PhaseStats phases[NUMBEROFPHASES];
+    };
+#endif
+#if ESP_METRICS
+    // What went wrong, see getMetrics()
+    enum FailureCause {
+      FAIL_TIMEOUT, // A command or response took too long
+      FAIL_ERROR, // The ESP8266 answered ERROR (or FAIL)
+      FAIL_SEND_FAIL, // SEND FAIL
+      FAIL_CLOSED, // A connection closed before its response was complete
+      FAIL_OVERFLOW, // Data lost to a full buffer
+      FAIL_RETRY, // A failed request was queued again (auto_retry)
+      FAIL_RECONNECT, // A connection or the network was joined again
+      FAIL_CIPSTATUS, // A network status check failed
+      NUMBEROFCAUSES
+    };
+    struct Metrics {
+      uint32_t counts[NUMBEROFCAUSES][STATEROWS]; // By state, see getStateName()
+    };
+#endif
+#if ESP_PROFILE
+    // ISR cost in one FSM state, see getProfile().  Cycles are counted by
+    // ESP_CYCLES(), the DWT cycle counter by default.
+    struct StateProfile {
+      uint32_t ticks; // ISR runs that began in this state
+      uint64_t totalCycles;
+      uint32_t maxCycles;
+      uint32_t rxBytes; // Bytes read from the ESP8266
+    };
+    struct Profile {
+      uint32_t cyclesPerMicro; // ESP_CYCLES_PER_SEC / 1000000
+      StateProfile states[STATEROWS]; // By state, see getStateName()
+      uint32_t histogram[PROFILEBUCKETS]; // ISR runs by duration
+    };
+#endif
+
     ESP8266();
     ESP8266(bool verboseSerial);
     ESP8266(int mode);
     ESP8266(int mode, bool verboseSerial);
-    void setPage(String directory, String html);
     void begin();
+#if ESP_EXTERNAL_TICK
+    void tick();
+#endif
+    bool isBusy();
+#if ESP_AP
+    void setPage(String directory, String html);
+    void setPageHandler(String directory, PageHandler handler);
+    bool startserver(String netName, String pass);
+    String getData();
+    bool hasData();
+    bool getRequest(APRequest *request);
+    void releaseRequest();
+#endif
+#if ESP_STATION
     bool isConnected();
     void connectWifi(String ssid, String password);
-    bool startserver(String netName, String pass);
-    bool isBusy();
-    void sendRequest(int type, String domain, int port, String path,
+    bool sendRequest(int type, String domain, int port, String path,
         String data);
-    void sendRequest(int type, String domain, int port, String path,
+    bool sendRequest(int type, String domain, int port, String path,
         String data, bool auto_retry);
-    void sendBigRequest(String domain, int port, String path,
+    bool sendRequest(int type, const char *domain, int port, const char *path,
+        const char *data, bool auto_retry = false);
+    bool sendRequest(int type, const char *domain, size_t domainLen, int port,
+        const char *path, size_t pathLen, const char *data, size_t dataLen,
+        bool auto_retry = false);
+#if ESP_UPLOADS
+    bool sendBigRequest(String domain, int port, String path,
         const char* data);
+    bool sendBigRequest(const char *domain, int port, const char *path,
+        const char *data, size_t dataLen);
+    bool sendUploadRequest(const char *domain, int port, const char *path,
+        UploadSource source);
+#endif
+#if ESP_STREAMING
+    bool sendStreamRequest(int type, const char *domain, int port,
+        const char *path, const char *data);
+    int readStream(char *buf, int len);
+    int streamAvailable();
+    bool isStreamOk();
+#endif
+    bool beginRequest(int type, const char *domain, int port,
+        const char *path, bool auto_retry = false);
+    bool addParam(const char *key, const char *value);
+    bool addParam(const char *key, long value);
+    bool appendData(const char *data, size_t len);
+    bool submitRequest();
+    void abortRequest();
     void clearRequest();
-    int benchmark;
     bool hasResponse();
     String getResponse();
+    int getResponseStatus();
+#if ESP_TIMING
+    RequestTiming getResponseTiming();
+    void getTimingStats(TimingStats *stats);
+    void resetTimingStats();
+#endif
+    bool isAutoConn();
+    void setAutoConn(bool value);
+    bool isKeepAlive();
+    void setKeepAlive(bool value);
+    void setKeepAlive(bool value, unsigned long idleTimeout);
+#endif
+    int benchmark;
     String getMAC();
     String getVersion();
     String getStatus();
     bool restore();
     bool reset();
     String sendCustomCommand(String command, unsigned long timeout);
-    bool isAutoConn();
-    void setAutoConn(bool value);
+    bool isStarting();
+    bool isStartupOk();
+    int getStartupProgress();
+    MemoryReport memoryReport();
+#if ESP_PROFILE
+    void getProfile(Profile *profile);
+    void resetProfile();
+#endif
+#if ESP_METRICS
+    void getMetrics(Metrics *metrics);
+    void resetMetrics();
+#endif
+    const char *getStateName(int row);
+    bool isAdaptiveTick();
+    void setAdaptiveTick(bool value);
+    unsigned long getTickMicros();
     int getTransmitCount();
     void resetTransmitCount();
     int getReceiveCount();
     void resetReceiveCount();
-    String getData();
-    bool hasData();
 
   private:
     static ESP8266 * _instance; //Static instance of this singleton class
@@ -159,35 +521,119 @@ class ESP8266 {
     static char const FAIL[];
     static char const STATUS[];
     static char const ALREADY_CONNECTED[];
-    static char const HTML_START[];
-    static char const HTML_END[];
     static char const SEND_FAIL[];
     static char const CLOSED[];
     static char const UNLINK[];
+    static char const IPD_FRAME[];
 
     // Private enums and structs
     enum RequestType {GET_REQ, POST_REQ};
+#if ESP_STATION
     struct Request {
       volatile char domain[DOMAINSIZE];
       volatile char path[PATHSIZE];
       volatile char data[DATASIZE+1];
+#if ESP_UPLOADS
       volatile char *data_ref;
       volatile int  data_len;
-      volatile long data_offset;
+      volatile long data_offset; //Bytes of data_ref taken so far
+      volatile UploadSource source; //Body producer of an upload, or NULL
+      volatile bool prepared; //data holds the next send
+      volatile bool source_done; //Source has no more body
+      volatile bool body_done; //Last chunk is in (or has left) data
+      volatile bool body_sent; //Some of the body has gone out
+      volatile bool big;
+#endif
+      volatile int send_len; //Bytes written for the current CIPSEND
       volatile int port;
       volatile RequestType type;
       volatile bool auto_retry;
       volatile bool ssl;
-      volatile bool big;
+#if ESP_STREAMING
+      volatile bool stream; //Body goes to the stream, not a response slot
+#endif
+      volatile bool ready; //Filled in and handed to the ISR
+      volatile bool done; //ISR has finished with this request
+#if ESP_TIMING
+      RequestTiming timing;
+#endif
     };
-    struct RequestAP {
-      volatile RequestType typeAP;
-      volatile char path[PATHSIZE];
-      volatile char data[DATASIZE];
+#endif
+#if ESP_AP
+    // A page's path and its rendered HTTP response, stored back to back in
+    // the page arena
+    struct Route {
+      uint32_t hash; // hashPath() of the path
+      uint16_t offset; // Start of the path in arena
+      uint16_t responseLen; // Head and html, or just the head for a handler
+      uint8_t pathLen;
+      uint8_t version; // Changed each time the page is replaced
+      PageHandler handler; // Makes the html after the head, or NULL
     };
+    // Pages set with setPage(), looked up by path through a hash index
+    // with linear probing.  Routes are never removed, so there are no
+    // tombstones; a replaced page's arena space is compacted away.
     struct Pages {
-      volatile char directory[NUMBEROFPAGES*PAGESIZE];
-      volatile char html[NUMBEROFPAGES*HTMLSTORAGE];
+      Route routes[NUMBEROFPAGES];
+      uint8_t index[ROUTEINDEXSIZE]; // Route number + 1, or 0 if empty
+      uint8_t count; // Routes in use
+      uint16_t used; // Arena bytes in use
+      char arena[PAGESTORAGE];
+    };
+    // Where an access point client, identified by its link ID, is
+    enum ClientState {
+      CLIENT_IDLE, // Not connected, or done
+      CLIENT_RECEIVING, // Collecting its request
+      CLIENT_SERVING, // Waiting for the channel to send (more of) the page
+      CLIENT_CLOSING, // Waiting for the channel to close the connection
+    };
+    // Where a part of a request is in its buffer
+    struct Span {
+      uint16_t at;
+      uint16_t len;
+    };
+    // The parts of a request requestParse() found, see APRequest
+    struct RequestSpans {
+      Span method, path, query, host, contentType, body;
+      uint32_t contentLength;
+      bool truncated;
+    };
+    struct Client {
+      volatile ClientState state;
+      volatile unsigned long timeoutStart;
+      int route; // Page being served, or -1 until it's looked up
+      uint32_t sent; // Bytes of the page sent so far
+      uint8_t version; // Route's version when serving started
+      bool lastChunk; // The part going out ends the page
+      bool complete; // The whole request arrived
+      uint8_t headMatch; // Chars of the "\r\n\r\n" ending the head seen
+      uint16_t rxLen; // Bytes in request
+      uint32_t bodyLeft; // Bytes of the body still to come
+      RequestSpans fields; // Valid once the head has arrived
+      char *request; // One of storage.ap.requests, tokenized in place
+    };
+#endif
+    // Station and access point mode never run together, so their storage
+    // overlaps.  Only the member for ESPmode is used.
+    union ModeStorage {
+#if ESP_STATION
+      struct {
+        Request requests[REQUESTQUEUESIZE];
+        volatile char response[RESPONSEQUEUESIZE][RESPONSESIZE];
+#if ESP_STREAMING
+        volatile char stream[STREAMSIZE];
+#endif
+      } station;
+#endif
+#if ESP_AP
+      struct {
+        // One per client, plus those held for the user (see getRequest())
+        char requests[APLINKS+APHELDREQUESTS][APREQUESTSIZE];
+        Pages pages;
+        Client clients[APLINKS];
+        char sendBuffer[APSENDSIZE]; // Part of a page going out
+      } ap;
+#endif
     };
     enum State {
       IDLE, //When nothing is happening
@@ -196,56 +642,261 @@ class ESP8266 {
       CIPSTART, //awaiting CIPSTART response
       CIPSEND, //awaiting CIPSEND response
       DATAOUT, //awaiting "SEND OK" confirmation
+#if ESP_UPLOADS
+      CHUNKOUT, //awaiting "SEND OK" for part of a big request
+#endif
       AWAITRESPONSE, //awaiting HTTP response
+      CIPCLOSE, //awaiting CIPCLOSE response
+    };
+    // Every string the FSMs look for in ESP8266 output.  Each one is a
+    // pattern in the streaming matcher; order must match TOKENS[].
+    enum Token {
+      READY_TOK,
+      OK_TOK,
+      OK_PROMPT_TOK,
+      SEND_OK_TOK,
+      ERROR_TOK,
+      FAIL_TOK,
+      STATUS_TOK,
+      ALREADY_CONNECTED_TOK,
+      SEND_FAIL_TOK,
+      CLOSED_TOK,
+      UNLINK_TOK,
+      IPD_FRAME_TOK,
+      NUMBEROFTOKENS
+    };
+    // Aho-Corasick automaton node, children kept as a sibling list
+    struct MatchNode {
+      char c;
+      uint8_t child;
+      uint8_t sibling;
+      uint8_t fail;
+      uint32_t out; //bitmask of tokens ending at this node
     };
+    // Matcher progress over one buffer (ISR only)
+    struct MatchState {
+      uint8_t node; // Matcher state after the last char
+      uint32_t seen; // Tokens found so far, one bit each
+      int pos[NUMBEROFTOKENS]; // Index of each token's first match
+    };
+#if ESP_STATION
+    // Where an HTTP response parser is in the response
+    enum HttpPhase {
+      HTTP_STATUS_LINE, // Reading "HTTP/1.1 200 OK"
+      HTTP_HEADER, // Reading header lines
+      HTTP_BODY, // Reading remaining bytes, or until the server closes if -1
+      HTTP_CHUNK_SIZE, // Reading a chunk's size line
+      HTTP_CHUNK_DATA, // Reading remaining bytes of a chunk
+      HTTP_CHUNK_CRLF, // Reading the CRLF after a chunk
+      HTTP_TRAILER, // Reading trailer lines after the last chunk
+      HTTP_DONE // Response complete
+    };
+    // Incremental HTTP/1.1 response parser (ISR only)
+    struct HttpParser {
+      HttpPhase phase;
+      int status; // Status code, 0 if not HTTP
+      long remaining;
+      bool chunked; // Transfer-Encoding: chunked
+      bool close; // Server closes the connection after this response
+      uint8_t lineLen;
+      char line[HTTPLINESIZE]; // Current line, cut to fit
+    };
+    // One station mode connection, identified by its link ID.  A link
+    // holds the AT command channel while in CIPSTART, CIPSEND or DATAOUT, and
+    // waits in AWAITRESPONSE without it.  IDLE with a request means the link
+    // is waiting to (re)connect; CIPCLOSE means it is waiting to be closed.
+    // IDLE without a request and not closed is a kept-alive connection to
+    // domain:port, waiting for another request there.
+    struct Link {
+      volatile State state;
+      volatile Request *request;
+      volatile char domain[DOMAINSIZE]; // Where the connection goes
+      volatile int port;
+      volatile bool ssl;
+      volatile bool reused; // Request is on a kept-alive connection
+      volatile int slot; // response[] slot payload is written to, or -1
+      volatile int rxLen; // Body bytes in response[slot]
+      volatile long rxTotal; // Bytes received for the request, head included
+      bool overflowed; // Some of the body didn't fit in response[slot]
+      volatile bool closed; // Modem reported "<id>,CLOSED"
+      volatile bool retryWait; // Failed; retry RETRY_DELAY after timeoutStart
+      volatile unsigned long timeoutStart;
+      volatile unsigned long rxTime; // SEND OK, then the last byte received
+      HttpParser http;
+    };
+#endif
+    // Position within a "+IPD,<id>,<len>:" frame
+    enum FrameState {
+      FRAME_NONE, // Control output from the modem
+      FRAME_LINK, // Reading "<id>,"
+      FRAME_LENGTH, // Reading "<len>:"
+      FRAME_PAYLOAD, // Reading <len> bytes of link data
+    };
+
+    // Token matcher, built once from TOKENS[] and shared by all instances
+    static char const * const TOKENS[NUMBEROFTOKENS];
+    static MatchNode matcher[MATCHERNODES];
+    static uint8_t matcherSize;
+    static uint8_t tokenLen[NUMBEROFTOKENS];
+    // The AT command channel in access point mode, used by one client at a
+    // time (activeClient)
     enum StateAP {
-      RESET,
-      AWAITCLIENT,
-      AWAITREQUEST, //awaiting client request
-      SENDRESPONSE, //return a response
+      AWAITCLIENT, //channel is free
+      SENDRESPONSE, //awaiting the CIPSEND prompt
       DATAOUTAP, //awaiting "SEND OK" confirmation
-      CLOSE, //close the connection
+      CLOSE, //awaiting the CIPCLOSE reply
+    };
+    // Startup scripts, in the order they run when more than one is pending
+    enum Script {
+      RESTORE_SCRIPT, // AT+RESTORE, before RESET_SCRIPT
+      RESET_SCRIPT, // Station mode reset
+      STATION_SCRIPT, // Station mode startup, from begin()
+      AP_SCRIPT, // Access point mode startup
+      SERVER_SCRIPT, // Access point server, from startserver()
+      NUMBEROFSCRIPTS
     };
+    // ScriptStep flags
+    enum {
+      STEP_OPTIONAL = 1, // Failing doesn't make the script fail
+      STEP_ABORT = 2, // Failing ends the script and drops pending ones
+      STEP_RESET = 4, // Restarts the modem
+      STEP_MAC = 8, // Reply holds the MAC address
+      STEP_CWSAP = 16, // Command takes the network name and password
+    };
+    // One AT command of a startup script.  A NULL command ends the script.
+    struct ScriptStep {
+      const char *command;
+      Token target; // Reply that means success
+      unsigned long timeout;
+      uint8_t tries; // Attempts before the step fails
+      const char *probe; // If the reply holds this, skip the next steps
+      uint8_t skip; // Number of steps to skip
+      uint8_t flags;
+    };
+    static const ScriptStep RESET_STEPS[];
+    static const ScriptStep STATION_STEPS[];
+    static const ScriptStep RESTORE_STEPS[];
+    static const ScriptStep AP_STEPS[];
+    static const ScriptStep SERVER_STEPS[];
+    static const ScriptStep * const SCRIPTS[NUMBEROFSCRIPTS];
+    static const char * const SCRIPT_NAMES[NUMBEROFSCRIPTS];
+    static const char * const STATE_NAMES[];
+    static const char * const STATE_AP_NAMES[];
 
     // Functions for strictly non-ISR context
     void enableTimer();
     void disableTimer();
     void init(int mode, bool verboseSerial);
-    bool checkPresent();
-    bool startAP();
-    void getMACFromDevice();
-    bool waitForTarget(const char *target, unsigned long timeout);
     bool stringToVolatileArray(String str, volatile char arr[],
         uint32_t len);
-    bool pagesAvailable();
-    bool pageExists(String directory);
-    String getPage(String dir);
-    void pageCreate(volatile char arr[], String directory);
-    void pageStore(volatile char arr[], String dir, String html);
+#if ESP_AP
+    bool startAP();
+    bool storePage(const char *path, size_t pathLen, const char *html,
+        size_t htmlLen, bool found, PageHandler handler);
+#endif
 
 
+    // Functions for any context
+    void requestScript(Script script);
+    void wakeTick();
+#if ESP_STATION
+    volatile Request *claimRequest();
+    volatile Request *openRequest(int type, const char *domain,
+        size_t domainLen, int port, const char *path, size_t pathLen,
+        bool auto_retry);
+    void publishRequest(volatile Request *r);
+    bool buildChar(char c);
+    bool buildEncoded(const char *s);
+#endif
+
     // Functions for ISR context
-    static void handleInterrupt(void);
-      static void handleInterruptAP(void);
-    void processInterrupt();
-      void processInterruptAP();
-    bool isTargetInResp(const char target[]);
-    bool getStringFromResp(const char *target, char *result);
-    bool getStringFromResp(const char *startTarget, const char *endTarget,
-        char *result);
+    bool isTargetInResp(Token target);
+    bool getStringFromResp(Token target, char *result);
+    bool getStringFromResp(Token startTarget, Token endTarget, char *result);
     int getStatusFromResp(); //Only call if we got an OK CIPSTATUS resp
+    bool runScript();
+    void sendStep(const ScriptStep *step);
+    void finishScript();
+    void dropLinks();
+    void getMACFromResp();
+    uint32_t matchChar(MatchState *m, char c, int index);
+    void resetMatch(MatchState *m);
+    void clearBuffer();
     void loadRx();
+    void dropBuffer(int n);
+    void truncateBuffer(int len);
+    void linkEvent(uint32_t tokens, int index);
+    int stateRow();
+#if ESP_METRICS
+    void countFailure(FailureCause cause, int row);
+    void countFailure(FailureCause cause);
+#endif
+    uint32_t tickState();
+    void adaptTick(uint32_t before);
+#if ESP_PROFILE
+    void profileBegin();
+    void profileEnd();
+#endif
     void emptyRx();
     void emptyRxAndBuffer();
-    void requestParse(String resp);
-    void findPage();
+    static void buildMatcher();
+    static uint8_t matcherChild(uint8_t node, char c);
+    static uint8_t matcherStep(uint8_t node, char c);
+#if ESP_STATION
+    static void handleInterrupt(void);
+    void processInterrupt();
+    bool dispatchLink();
+    void startLink(int id);
+    void startSend(int id);
+    int prepareSend();
+    static int requestLength(RequestType type, size_t domainLen, int port,
+        size_t pathLen, size_t dataLen);
+    static int numDigits(long n, int base);
+    bool rewindRequest(volatile Request *r);
+    bool reconnectLink(int id);
+    bool linkGoesTo(int id, volatile Request *r);
+    void processLink(int id);
+    void finishLink(int id);
+    void failLink(int id, bool needClose);
+    void cancelPending();
+    void endRequest(volatile Request *r, bool ok);
+#if ESP_TIMING
+    void recordTiming(int id);
+    void addPhase(int phase, uint32_t from, uint32_t to);
+    static int timingBucket(uint32_t micros);
+#endif
+    void retireRequests();
+    void linkReceive(int id, char c);
+    void httpLine(HttpParser *p);
+    void storeBody(Link *l, char c);
+    void resetReceive(int id);
+#endif
+#if ESP_UPLOADS
+    volatile Request *openUpload(const char *domain, int port,
+        const char *path);
+    int buildUpload(volatile Request *r);
+    int fillUpload(volatile Request *r, char *buf, int len);
+#endif
+#if ESP_AP
+    static void handleInterruptAP(void);
+    void processInterruptAP();
+    void clientReceive(int id, char c);
+    void requestParse(int id);
+    static const char *spanText(const char *text, Span span);
+    void endClient(int id);
+    bool dispatchClient();
+    static uint32_t hashPath(const char *path, size_t len);
+    int findRoute(const char *path, size_t len);
+    void findPage(int id);
+    int nextChunk(int id);
     void servePage();
-    bool setServer();
+#endif
 
 
     // Non-ISR variables
-    String MAC;
+#if !ESP_EXTERNAL_TICK
     IntervalTimer timer;
+#endif
     int ESPmode;
 
 
@@ -254,24 +905,123 @@ class ESP8266 {
     volatile bool newNetworkInfo;
     volatile char ssid[SSIDSIZE];
     volatile char password[PASSWORDSIZE];
-    volatile bool connected;
-    volatile bool doAutoConn;
-    volatile bool hasRequest;
-    volatile Request *request_p;
-    volatile bool responseReady;
-    volatile char response[RESPONSESIZE];
+    ModeStorage storage;
     volatile int transmitCount;
     volatile int receiveCount;
+    volatile char MAC[MACSIZE+1];
+
+    // Startup scripts.  User calls set bits in scriptsPending; the ISR runs
+    // the scripts one at a time, in Script order.
+    volatile uint8_t scriptsPending; // One bit per Script
+    volatile int8_t scriptRunning; // Script the ISR is running, or -1
+    volatile uint8_t scriptStep; // Index of its current step
+    bool stepSent; // Step's command is out, waiting for the reply (ISR only)
+    uint8_t stepTries; // Failed attempts at the current step (ISR only)
+    bool scriptReset; // Modem restarted during this script (ISR only)
+    volatile bool startupOk; // No required step has failed
+
+    // Adaptive tick.  The ISR slows its timer while nothing happens, and
+    // user calls that give it work bring it back to full speed.
+    volatile bool adaptiveTick;
+    volatile bool tickWake; // Work was submitted since the last tick
+    volatile unsigned long tickMicros; // Timer period now
+    uint8_t quietTicks; // Ticks at this speed with nothing done (ISR only)
+    bool rxSeen; // loadRx() read something this tick (ISR only)
+
+#if ESP_METRICS
+    // Written by the ISR only, like the profile below
+    Metrics metricsData;
+    volatile uint32_t metricsSeq;
+    volatile bool metricsClear; // resetMetrics() was called
+#endif
+#if ESP_PROFILE
+    // Written by the ISR only.  profileSeq changes around each update, so
+    // getProfile() can tell if its copy was interrupted.
+    Profile profileData;
+    volatile uint32_t profileSeq;
+    volatile bool profileClear; // resetProfile() was called
+    uint32_t profileStart; // Cycle count at ISR entry
+    uint32_t profileRx; // Bytes read this tick
+    int profileRow; // Row this tick is counted in
+#endif
+
+#if ESP_STATION
+    volatile bool connected;
+    volatile bool doAutoConn;
     volatile bool reqReconn;
+    volatile bool keepAlive; // Leave links open for more requests to the host
+    volatile unsigned long keepAliveTimeout; // Idle time before closing them
+    volatile Request *building; // Slot held by beginRequest(), or NULL
+    int buildLen; // Bytes of data added to it so far
+    bool buildFailed; // Something didn't fit
+    volatile Request *request_p; // Request of the link holding the channel
+    volatile char (*response)[RESPONSESIZE]; // Response slots, in storage
+    volatile bool slotFree[RESPONSEQUEUESIZE]; // response[] slot ownership
+    volatile int responseStatus[RESPONSEQUEUESIZE]; // HTTP status per slot
+    int lastStatus; // Status of the response getResponse() returned last
+#if ESP_TIMING
+    RequestTiming responseTiming[RESPONSEQUEUESIZE]; // Per slot
+    RequestTiming lastTiming; // Of the response getResponse() returned last
+
+    // Running totals per Phase, written by the ISR only.  timingSeq changes
+    // around each update so getTimingStats() can tell if it was interrupted.
+    struct PhaseTotals {
+      uint32_t count, min, max;
+      uint64_t total;
+      uint16_t buckets[TIMINGBUCKETS]; // See timingBucket()
+    };
+    PhaseTotals phaseTotals[NUMBEROFPHASES];
+    volatile uint32_t timingSeq;
+    volatile bool timingClear; // resetTimingStats() was called
+#endif
 
+    // Request and response rings.  Indices are free-running and masked on
+    // use.  Requests may be submitted from any context: producers reserve a
+    // slot by compare-and-swap on requestHead and publish it by setting its
+    // ready flag, and the ISR consumes slots in order.  Responses go from the
+    // ISR to user calls; the ISR may also drop the oldest unread response
+    // unless getResponse() is reading it.
+    volatile Request *requestQueue; // In storage
+    volatile uint8_t requestHead; // Next slot to reserve
+    volatile uint8_t requestTail; // Oldest request the ISR isn't done with
+    volatile uint8_t requestNext; // Next request to give a link (ISR only)
+    volatile uint8_t completionQueue[RESPONSEQUEUESIZE]; // response[] slots,
+    volatile uint8_t responseHead;                       // in completion order
+    volatile uint8_t responseTail;
+    volatile int readingSlot; // response[] slot getResponse() is copying, or -1
+    volatile bool cancelRequested; // Set by clearRequest(), handled by ISR
+    volatile uint8_t cancelHead; // requestHead at the time of clearRequest()
+#endif
+
+#if ESP_STREAMING
+    // Body of the streamed request, from the ISR to readStream().  Indices
+    // are free-running and masked on use.
+    volatile char *streamBuffer; // In storage
+    volatile uint16_t streamHead; // Written by the ISR
+    volatile uint16_t streamTail; // Written by readStream()
+    volatile bool streamActive; // A streamed request is queued, in flight or unread
+    volatile bool streamEnded; // ISR is done with it
+    volatile bool streamFailed; // It failed, or bytes were lost
+#endif
+
+#if ESP_AP
     //Shared variables for AP
-    volatile bool dataReady;
-    volatile int linkID;
-    volatile Pages *storedPages;
-    volatile RequestAP *requestAP_p;
-    volatile int debugCount;
-    volatile bool first;
+    volatile Pages *storedPages; // In storage
+    Client *clients; // In storage, indexed by link ID
+    // Finished requests for getRequest(), oldest first.  Indices are
+    // free-running and masked on use; the ISR adds at heldHead and the user
+    // releases at heldTail.
+    char *heldRequests[APHELDREQUESTS]; // In storage
+    RequestSpans heldFields[APHELDREQUESTS];
+    volatile uint8_t heldHead;
+    volatile uint8_t heldTail;
+    volatile bool pagesBusy; // setPage() is writing storedPages
+    volatile int activeClient; // Client holding the AT command channel, or -1
+    int nextClient; // Client to look at first for the channel (ISR only)
+    int sendLen; // Bytes in sendBuffer (ISR only)
+#endif
     volatile bool serverStatus;
+    volatile int debugCount;
 
     // Variables for interrupt routines
     volatile State state;
@@ -279,6 +1029,37 @@ class ESP8266 {
     volatile unsigned long lastConnectionCheck;
     volatile unsigned long timeoutStart;
     volatile char inputBuffer[BUFFERSIZE];  // Serial input loaded here
+    volatile int bufferLen; // Number of chars in inputBuffer
+    MatchState control; // Matcher progress over inputBuffer
+    uintptr_t isrStackBase; // Stack pointer at ISR entry, 0 outside the ISR
+    volatile size_t isrStackPeak; // Deepest ISR stack use seen, in bytes
+#if ESP_STATION
+    Link links[STATIONLINKS];
+    volatile int activeLink; // Link holding the AT command channel, or -1
+#endif
+    volatile FrameState frameState;
+    // Link notices ("+IPD," and "<id>,CLOSED") are matched apart from
+    // control, so clearing inputBuffer doesn't lose one that is half in
+    uint8_t noticeNode; // Matcher state over the control chars
+    char noticePrev; // Last control char
+    uint8_t noticeLink; // <id> of the last "<id>,"
+    uint8_t noticeGap; // Control chars since that ",", up to 255
+    volatile int frameValue;
+    volatile int frameLink;
+    volatile int frameRemaining;
+};
+
+// The sizes change the layout too, and token pasting can't take an
+// expression like -DDATASIZE=(512), so they're checked the same way through
+// a template named after them, and after the class size for any not listed.
+template <unsigned long... sizes> struct EspSizes {
+  static const char check;
 };
+#define ESP_SIZES EspSizes<sizeof(ESP8266), BUFFERSIZE, RESPONSESIZE, \
+  DOMAINSIZE, PATHSIZE, DATASIZE, NUMBEROFPAGES, PAGESIZE, PAGESTORAGE, \
+  APREQUESTSIZE, APSENDSIZE, APHELDREQUESTS, ROUTEINDEXSIZE, \
+  REQUESTQUEUESIZE, RESPONSEQUEUESIZE, STATIONLINKS, STREAMSIZE, HTTPLINESIZE>
+static const char * const espSizesCheck __attribute__((used)) =
+  &ESP_SIZES::check;
 
 #endif
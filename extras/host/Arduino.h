@@ -0,0 +1,83 @@
+// Stand-in for the parts of Teensy's Arduino.h the library uses, so it can
+// be built and run on Linux.  Time is virtual (see host.h): millis() and
+// micros() only move when the harness says so, which keeps runs repeatable.
+
+#ifndef Arduino_h
+#define Arduino_h
+
+#include <ctype.h>
+#include <stdint.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <strings.h>
+#include "WString.h"
+
+#define DEC 10
+#define HEX 16
+
+unsigned long millis();
+unsigned long micros();
+void delay(unsigned long ms);
+void yield();
+
+// Host time in nanoseconds, for ESP_CYCLES() in ESP_PROFILE builds
+uint32_t hostCycles();
+
+// The constructors are constexpr, and Serial1 is a function, so the ports
+// work from the constructors of a sketch's global objects, which may run
+// before theirs would
+class Print {
+  public:
+    constexpr Print() {}
+    virtual size_t write(uint8_t c) = 0;
+    virtual size_t write(const uint8_t *buf, size_t len);
+    size_t write(const char *buf, size_t len) {
+      return write((const uint8_t *)buf, len);
+    }
+    size_t print(const char *s);
+    size_t print(char c);
+    size_t print(const String &s);
+    size_t print(int n, int base = DEC);
+    size_t print(unsigned int n, int base = DEC);
+    size_t print(long n, int base = DEC);
+    size_t print(unsigned long n, int base = DEC);
+    size_t print(double n);
+    size_t println();
+    size_t println(const char *s);
+    size_t println(char c);
+    size_t println(const String &s);
+    size_t println(int n, int base = DEC);
+    size_t println(unsigned int n, int base = DEC);
+    size_t println(long n, int base = DEC);
+    size_t println(unsigned long n, int base = DEC);
+    size_t println(double n);
+};
+
+class HardwareSerial : public Print {
+  public:
+    constexpr HardwareSerial() {}
+    virtual void begin(unsigned long baud) { (void)baud; }
+    virtual int available() { return 0; }
+    virtual int read() { return -1; }
+    virtual int peek() { return -1; }
+    virtual void flush() {}
+    using Print::write;
+    virtual size_t write(uint8_t c) { (void)c; return 1; }
+    operator bool() { return true; }
+};
+
+// The USB serial port, printed to stdout when host::console is set
+class HostConsole : public HardwareSerial {
+  public:
+    constexpr HostConsole() {}
+    using Print::write;
+    size_t write(uint8_t c);
+    size_t write(const uint8_t *buf, size_t len);
+};
+
+extern HostConsole Serial;
+HardwareSerial &hostSerial1(); // The emulated ESP8266, see Modem.h
+#define Serial1 hostSerial1()
+
+#endif
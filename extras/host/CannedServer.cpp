@@ -0,0 +1,38 @@
+#include "CannedServer.h"
+
+CannedServer::CannedServer(const Handler &h) : handler(h) {
+  connectMicros = 20000;
+  responseMicros = 30000;
+  refuse = false;
+  requests = 0;
+}
+
+void CannedServer::connect(Modem &modem, int link, const std::string &host,
+    int port) {
+  (void)host;
+  (void)port;
+  parsers[link].reset();
+  modem.connected(link, !refuse, connectMicros);
+}
+
+bool CannedServer::send(Modem &modem, int link, const std::string &data) {
+  for (size_t i = 0; i < data.size(); i++) {
+    if (!parsers[link].feed(data[i])) {
+      continue;
+    }
+    const HttpRequest &request = parsers[link].request;
+    HttpResponse response = handler(request);
+    response.close = response.close || request.close;
+    requests++;
+    modem.received(link, response.text(), responseMicros);
+    if (response.close) {
+      modem.peerClosed(link, responseMicros);
+    }
+  }
+  return true;
+}
+
+void CannedServer::close(Modem &modem, int link) {
+  (void)modem;
+  parsers[link].reset();
+}
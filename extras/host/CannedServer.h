@@ -0,0 +1,31 @@
+// A Network whose every connection goes to an HTTP server inside the
+// harness, answering from a handler after a set delay.  Runs on virtual
+// time, so a benchmark on it gives the same result every time.
+
+#ifndef CannedServer_h
+#define CannedServer_h
+
+#include <functional>
+#include "Http.h"
+#include "Modem.h"
+
+class CannedServer : public Network {
+  public:
+    typedef std::function<HttpResponse(const HttpRequest &)> Handler;
+
+    CannedServer(const Handler &handler);
+    void connect(Modem &modem, int link, const std::string &host, int port);
+    bool send(Modem &modem, int link, const std::string &data);
+    void close(Modem &modem, int link);
+
+    uint32_t connectMicros; // CIPSTART to CONNECT, a TCP handshake
+    uint32_t responseMicros; // Request to response
+    bool refuse; // Refuse connections
+    uint32_t requests; // Answered so far
+
+  private:
+    Handler handler;
+    HttpRequestParser parsers[MODEM_LINKS];
+};
+
+#endif
@@ -0,0 +1,120 @@
+#include "Http.h"
+#include <stdio.h>
+#include <stdlib.h>
+#include <strings.h>
+
+std::string HttpResponse::text() const {
+  const char *reason = status == 200 ? "OK" : status == 404 ? "Not Found"
+    : status == 500 ? "Internal Server Error" : "Status";
+  std::string t = "HTTP/1.1 " + std::to_string(status) + " " + reason
+    + "\r\nContent-Type: text/plain\r\n";
+  if (close) {
+    t += "Connection: close\r\n";
+  }
+  if (!chunked) {
+    long len = length >= 0 ? length : (long)body.size();
+    return t + "Content-Length: " + std::to_string(len) + "\r\n\r\n" + body;
+  }
+  t += "Transfer-Encoding: chunked\r\n\r\n";
+  if (!body.empty()) {
+    char size[24];
+    snprintf(size, sizeof(size), "%zx\r\n", body.size());
+    t += size + body + "\r\n";
+  }
+  return t + "0\r\n\r\n";
+}
+
+HttpRequestParser::HttpRequestParser() {
+  reset();
+}
+
+void HttpRequestParser::reset() {
+  phase = REQUEST_LINE;
+  line.clear();
+  remaining = 0;
+  done = false;
+  request = HttpRequest();
+}
+
+bool HttpRequestParser::feed(char c) {
+  if (done) {
+    reset();
+  }
+  switch (phase) {
+    case BODY:
+      request.body += c;
+      done = --remaining == 0;
+      return done;
+    case CHUNK_DATA:
+      request.body += c;
+      if (--remaining == 0) {
+        phase = CHUNK_CRLF;
+      }
+      return false;
+    case CHUNK_CRLF:
+      if (c == '\n') {
+        phase = CHUNK_SIZE;
+      }
+      return false;
+    default:
+      break;
+  }
+  if (c == '\r') {
+    return false;
+  }
+  if (c != '\n') {
+    line += c;
+    return false;
+  }
+  done = endLine();
+  line.clear();
+  return done;
+}
+
+// Handles a line of the head, a chunk size or a trailer.  Returns true if
+// it ended the request.
+bool HttpRequestParser::endLine() {
+  switch (phase) {
+    case REQUEST_LINE: // "GET /path?query HTTP/1.1"
+      {
+      if (line.empty()) {
+        return false; // Stray CRLF between requests
+      }
+      size_t sp1 = line.find(' ');
+      size_t sp2 = line.find(' ', sp1 + 1);
+      request.method = line.substr(0, sp1);
+      request.target = sp1 == std::string::npos ? ""
+        : line.substr(sp1 + 1, sp2 - sp1 - 1);
+      request.close = line.find("HTTP/1.0") != std::string::npos;
+      remaining = 0;
+      phase = HEADER;
+      }
+      return false;
+    case HEADER:
+      if (line.empty()) {
+        if (remaining < 0) { // Chunked
+          phase = CHUNK_SIZE;
+          return false;
+        }
+        phase = BODY;
+        return remaining == 0;
+      }
+      if (strncasecmp(line.c_str(), "Content-Length:", 15) == 0) {
+        remaining = atol(line.c_str() + 15);
+      } else if (strncasecmp(line.c_str(), "Transfer-Encoding:", 18) == 0
+          && line.find("chunked") != std::string::npos) {
+        remaining = -1;
+      } else if (strncasecmp(line.c_str(), "Connection:", 11) == 0) {
+        request.close = line.find("close") != std::string::npos;
+      }
+      return false;
+    case CHUNK_SIZE:
+      remaining = strtol(line.c_str(), NULL, 16);
+      phase = remaining > 0 ? CHUNK_DATA : TRAILER;
+      return false;
+    case TRAILER:
+      return line.empty();
+    default:
+      return false;
+  }
+}
@@ -0,0 +1,47 @@
+// Just enough HTTP/1.1 for the harness's servers: requests parsed a byte at
+// a time as they come off a connection, and responses to send back
+
+#ifndef Http_h
+#define Http_h
+
+#include <string>
+
+struct HttpRequest {
+  std::string method;
+  std::string target; // Path and query
+  std::string body; // With any chunked encoding taken off
+  bool close; // Connection: close, or HTTP/1.0
+};
+
+struct HttpResponse {
+  HttpResponse(int status = 200, const std::string &body = "")
+    : status(status), body(body), chunked(false), close(false), length(-1) {}
+  int status;
+  std::string body;
+  bool chunked; // Send the body as one chunk, and the last chunk
+  bool close; // Close the connection after it
+  long length; // Content-Length to give, if not -1; body is then its start
+  std::string text() const;
+};
+
+class HttpRequestParser {
+  public:
+    HttpRequestParser();
+    void reset();
+    // Takes the next byte of the connection.  Returns true when it finished
+    // a request, which is then in request until the next feed().
+    bool feed(char c);
+    HttpRequest request;
+
+  private:
+    enum Phase {
+      REQUEST_LINE, HEADER, BODY, CHUNK_SIZE, CHUNK_DATA, CHUNK_CRLF, TRAILER
+    };
+    bool endLine();
+    Phase phase;
+    std::string line;
+    long remaining;
+    bool done;
+};
+
+#endif
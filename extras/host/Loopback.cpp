@@ -0,0 +1,117 @@
+#include <arpa/inet.h>
+#include <errno.h>
+#include <fcntl.h>
+#include <netinet/in.h>
+#include <netinet/tcp.h>
+#include <poll.h>
+#include <sys/socket.h>
+#include <unistd.h>
+#include "Loopback.h"
+
+LoopbackNetwork::LoopbackNetwork(int p) : port(p) {
+  for (int i = 0; i < MODEM_LINKS; i++) {
+    fds[i] = -1;
+    connecting[i] = false;
+  }
+}
+
+LoopbackNetwork::~LoopbackNetwork() {
+  for (int i = 0; i < MODEM_LINKS; i++) {
+    if (fds[i] >= 0) {
+      ::close(fds[i]);
+    }
+  }
+}
+
+void LoopbackNetwork::connect(Modem &modem, int link, const std::string &host,
+    int p) {
+  (void)host;
+  if (fds[link] >= 0) {
+    ::close(fds[link]);
+  }
+  int fd = socket(AF_INET, SOCK_STREAM, 0);
+  int one = 1;
+  setsockopt(fd, IPPROTO_TCP, TCP_NODELAY, &one, sizeof(one));
+  fcntl(fd, F_SETFL, fcntl(fd, F_GETFL) | O_NONBLOCK);
+  struct sockaddr_in addr;
+  memset(&addr, 0, sizeof(addr));
+  addr.sin_family = AF_INET;
+  addr.sin_port = htons(port != 0 ? port : p);
+  addr.sin_addr.s_addr = htonl(INADDR_LOOPBACK);
+  if (::connect(fd, (struct sockaddr *)&addr, sizeof(addr)) == 0) {
+    fds[link] = fd;
+    modem.connected(link, true);
+  } else if (errno == EINPROGRESS) {
+    fds[link] = fd;
+    connecting[link] = true; // poll() finds out
+  } else {
+    ::close(fd);
+    modem.connected(link, false);
+  }
+}
+
+bool LoopbackNetwork::send(Modem &modem, int link, const std::string &data) {
+  (void)modem;
+  int fd = fds[link];
+  for (size_t at = 0; fd >= 0 && at < data.size(); ) {
+    ssize_t n = ::send(fd, data.data() + at, data.size() - at, MSG_NOSIGNAL);
+    if (n > 0) {
+      at += n;
+    } else if (n < 0 && errno == EAGAIN) {
+      struct pollfd pfd = {fd, POLLOUT, 0};
+      ::poll(&pfd, 1, 100);
+    } else {
+      return false;
+    }
+  }
+  return fd >= 0;
+}
+
+void LoopbackNetwork::close(Modem &modem, int link) {
+  (void)modem;
+  if (fds[link] >= 0) {
+    ::close(fds[link]);
+    fds[link] = -1;
+  }
+  connecting[link] = false;
+}
+
+// Finishes connections and hands the modem what the servers sent
+void LoopbackNetwork::poll(Modem &modem) {
+  for (int i = 0; i < MODEM_LINKS; i++) {
+    int fd = fds[i];
+    if (fd < 0) {
+      continue;
+    }
+    if (connecting[i]) {
+      struct pollfd pfd = {fd, POLLOUT, 0};
+      if (::poll(&pfd, 1, 0) <= 0) {
+        continue;
+      }
+      int err = 0;
+      socklen_t len = sizeof(err);
+      getsockopt(fd, SOL_SOCKET, SO_ERROR, &err, &len);
+      connecting[i] = false;
+      modem.connected(i, err == 0);
+      if (err != 0) {
+        ::close(fd);
+        fds[i] = -1;
+      }
+      continue;
+    }
+    std::string data;
+    char buf[4096];
+    ssize_t n;
+    while ((n = recv(fd, buf, sizeof(buf), 0)) > 0) {
+      data.append(buf, n);
+    }
+    if (!data.empty()) {
+      modem.received(i, data);
+    }
+    if (n == 0 || (n < 0 && errno != EAGAIN)) {
+      ::close(fd);
+      fds[i] = -1;
+      modem.peerClosed(i);
+    }
+  }
+}
@@ -0,0 +1,26 @@
+// A Network of real TCP connections to servers on 127.0.0.1.  Sockets run
+// on the wall clock, so use it with host::realTime set.
+
+#ifndef Loopback_h
+#define Loopback_h
+
+#include "Modem.h"
+
+class LoopbackNetwork : public Network {
+  public:
+    // Connects every CIPSTART to port, or to the port it names if 0.  The
+    // host it names is ignored.
+    LoopbackNetwork(int port = 0);
+    ~LoopbackNetwork();
+    void connect(Modem &modem, int link, const std::string &host, int port);
+    bool send(Modem &modem, int link, const std::string &data);
+    void close(Modem &modem, int link);
+    void poll(Modem &modem);
+
+  private:
+    int port;
+    int fds[MODEM_LINKS]; // -1 if closed
+    bool connecting[MODEM_LINKS];
+};
+
+#endif
@@ -0,0 +1,556 @@
+#include "Modem.h"
+#include "host.h"
+
+Modem &hostModem() {
+  static Modem m;
+  return m;
+}
+
+Modem &modem = hostModem();
+
+static const char OK_REPLY[] = "\r\nOK\r\n";
+static const char ERROR_REPLY[] = "\r\nERROR\r\n";
+// What the modem prints as it restarts: its ROM's boot message at 74880
+// baud, which is noise at 115200, then its firmware's banner
+static const char BOOT_MESSAGE[] = "\r\n\xe4\x8c\x12\xf2\x82\x0c\x8c\xec"
+  "\r\n[Vendor:www.ai-thinker.com Version:1.5.4]\r\n\r\nready\r\n";
+
+Modem::Modem() {
+  baud = 115200;
+  rxBufferSize = 1024;
+  echo = true;
+  bootMicros = 300000;
+  joinMicros = 2000000;
+  ackMicros = 2000;
+  network = NULL;
+  memset(&faults, 0, sizeof(faults));
+  offline = false;
+  cwmode = 3; // Station and access point, as shipped
+  autoConnect = true;
+  joinedBefore = false;
+  reset();
+}
+
+void Modem::reset() {
+  toModem.clear();
+  fromModem.clear();
+  rx.clear();
+  events.clear();
+  toCredit = 0;
+  fromCredit = 0;
+  lastUpdate = host::now();
+  memset(&stats, 0, sizeof(stats));
+  mode = COMMAND;
+  busy = false;
+  line.clear();
+  for (int i = 0; i < MODEM_LINKS; i++) {
+    links[i].open = false;
+    links[i].connecting = false;
+    links[i].dead = false;
+  }
+  joined = autoConnect && joinedBefore && !offline;
+  mux = false;
+  server = false;
+}
+
+int Modem::available() {
+  if (rx.empty() && !host::ticking()) {
+    // Polled outside the library's tick, as sendCustomCommand() does:
+    // let a byte's worth of time pass, or the wait would never end
+    host::advance(10000000 / baud + 1);
+  }
+  return rx.size();
+}
+
+int Modem::read() {
+  if (rx.empty()) {
+    return -1;
+  }
+  unsigned char c = rx.front();
+  rx.pop_front();
+  return c;
+}
+
+int Modem::peek() {
+  return rx.empty() ? -1 : (unsigned char)rx.front();
+}
+
+size_t Modem::write(uint8_t c) {
+  toModem.push_back(c);
+  stats.written++;
+  return 1;
+}
+
+size_t Modem::write(const uint8_t *buf, size_t len) {
+  toModem.insert(toModem.end(), buf, buf + len);
+  stats.written += len;
+  return len;
+}
+
+// The UART has no more than baud/10 bytes a second in each direction.
+// Credit is in bit-microseconds, and doesn't build up while the line is idle.
+size_t Modem::budget(std::deque<char> &wire, uint64_t &credit, uint64_t elapsed) {
+  if (wire.empty()) {
+    credit = 0;
+    return 0;
+  }
+  credit += elapsed * baud;
+  size_t n = credit / 10000000;
+  credit -= (uint64_t)n * 10000000;
+  return n < wire.size() ? n : wire.size();
+}
+
+void Modem::update() {
+  uint64_t now = host::now();
+  uint64_t elapsed = now - lastUpdate;
+  lastUpdate = now;
+  while (!events.empty() && events.begin()->first <= now) {
+    std::function<void()> fn = events.begin()->second.fn;
+    events.erase(events.begin());
+    fn();
+  }
+  if (network != NULL) {
+    network->poll(*this);
+  }
+  for (size_t n = budget(toModem, toCredit, elapsed); n > 0; n--) {
+    char c = toModem.front();
+    toModem.pop_front();
+    arrive(c);
+  }
+  for (size_t n = budget(fromModem, fromCredit, elapsed); n > 0; n--) {
+    if (rx.size() < rxBufferSize) {
+      rx.push_back(fromModem.front());
+      stats.delivered++;
+    } else {
+      stats.overruns++; // The library didn't read in time
+    }
+    fromModem.pop_front();
+  }
+}
+
+void Modem::setNetwork(Network *n) {
+  network = n;
+}
+
+void Modem::setFaults(const Faults &f) {
+  faults = f;
+  random.seed(f.seed);
+}
+
+bool Modem::chance(double rate) {
+  return rate > 0 && std::uniform_real_distribution<double>()(random) < rate;
+}
+
+void Modem::outage(uint32_t startMicros, uint32_t lengthMicros) {
+  Event start = {[this]() {
+    offline = true;
+    disconnect();
+  }, true};
+  Event end = {[this]() {
+    offline = false;
+    if (autoConnect && joinedBefore && mode != BOOTING) {
+      after(joinMicros, [this]() {
+        if (!offline && !joined) {
+          joined = true;
+          out("WIFI CONNECTED\r\nWIFI GOT IP\r\n");
+        }
+      });
+    }
+  }, true};
+  events.insert(std::make_pair(host::now() + startMicros, start));
+  events.insert(std::make_pair(host::now() + startMicros + lengthMicros, end));
+}
+
+bool Modem::isJoined() {
+  return joined;
+}
+
+// Leaves the network, which drops every connection
+void Modem::disconnect() {
+  if (!joined) {
+    return;
+  }
+  joined = false;
+  out("WIFI DISCONNECT\r\n");
+  for (int i = 0; i < MODEM_LINKS; i++) {
+    close(i, true);
+  }
+}
+
+void Modem::script(const char *prefix, const char *reply, int times,
+    uint32_t delayMicros) {
+  Rule r = {prefix, reply, times, delayMicros};
+  rules.push_back(r);
+}
+
+void Modem::clearScript() {
+  rules.clear();
+}
+
+void Modem::say(const std::string &text, uint32_t delayMicros) {
+  if (delayMicros == 0) {
+    out(text);
+  } else {
+    after(delayMicros, [this, text]() { out(text); });
+  }
+}
+
+void Modem::feed(const char *d, size_t len) {
+  rx.insert(rx.end(), d, d + len);
+  stats.delivered += len;
+}
+
+void Modem::after(uint32_t delayMicros, const std::function<void()> &fn) {
+  Event e = {fn, false};
+  events.insert(std::make_pair(host::now() + delayMicros, e));
+}
+
+void Modem::out(const std::string &text) {
+  fromModem.insert(fromModem.end(), text.begin(), text.end());
+}
+
+// A byte from the library reaches the modem
+void Modem::arrive(char c) {
+  if (mode == BOOTING) {
+    return;
+  }
+  if (mode == DATA) {
+    data += c;
+    if (--dataLeft == 0) {
+      sent();
+    }
+    return;
+  }
+  if (echo) {
+    fromModem.push_back(c);
+  }
+  if (c != '\n') {
+    line += c;
+    return;
+  }
+  if (!line.empty() && line[line.size()-1] == '\r') {
+    line.erase(line.size()-1);
+  }
+  std::string l = line;
+  line.clear();
+  if (l.empty()) {
+    return;
+  }
+  stats.commands++;
+  if (busy) {
+    out("busy p...\r\n");
+  } else if (!runRule(l)) {
+    command(l);
+  }
+}
+
+bool Modem::runRule(const std::string &l) {
+  for (size_t i = 0; i < rules.size(); i++) {
+    Rule *r = &rules[i];
+    if (r->times != 0 && l.compare(0, r->prefix.size(), r->prefix) == 0) {
+      if (r->times > 0) {
+        r->times--;
+      }
+      if (!r->reply.empty()) {
+        say(r->reply, r->delayMicros);
+      }
+      return true;
+    }
+  }
+  return false;
+}
+
+static bool startsWith(const std::string &s, const char *prefix) {
+  return s.compare(0, strlen(prefix), prefix) == 0;
+}
+
+void Modem::command(const std::string &l) {
+  if (l == "AT" || l == "ATE1" || l == "ATE0") {
+    if (l != "AT") {
+      echo = l == "ATE1";
+    }
+    out(OK_REPLY);
+  } else if (l == "AT+RST" || l == "AT+RESTORE") {
+    out(OK_REPLY);
+    boot(l == "AT+RESTORE");
+  } else if (l == "AT+GMR") {
+    out("AT version:1.2.0.0(Jul  1 2016 20:04:45)\r\n"
+        "SDK version:1.5.4.1(39cb9a32)\r\n");
+    out(OK_REPLY);
+  } else if (l == "AT+CWMODE_DEF?" || l == "AT+CWMODE?") {
+    out("+CWMODE_DEF:" + std::to_string(cwmode) + "\r\n");
+    out(OK_REPLY);
+  } else if (startsWith(l, "AT+CWMODE_DEF=") || startsWith(l, "AT+CWMODE=")) {
+    int m = atoi(l.c_str() + l.find('=') + 1);
+    if (m < 1 || m > 3) {
+      out(ERROR_REPLY);
+      return;
+    }
+    cwmode = m;
+    out(OK_REPLY);
+  } else if (startsWith(l, "AT+CWAUTOCONN=")) {
+    autoConnect = l[14] == '1';
+    out(OK_REPLY);
+  } else if (l == "AT+CIPAPMAC?") {
+    out("+CIPAPMAC:\"1a:fe:34:00:00:01\"\r\n");
+    out(OK_REPLY);
+  } else if (startsWith(l, "AT+CIPSSLSIZE=")) {
+    out(OK_REPLY);
+  } else if (l == "AT+CIPMUX?") {
+    out(std::string("+CIPMUX:") + (mux ? "1" : "0") + "\r\n");
+    out(OK_REPLY);
+  } else if (startsWith(l, "AT+CIPMUX=")) {
+    bool m = l[10] == '1';
+    for (int i = 0; i < MODEM_LINKS; i++) {
+      if (links[i].open && m != mux) {
+        out("link is builded\r\n");
+        out(ERROR_REPLY);
+        return;
+      }
+    }
+    mux = m;
+    out(OK_REPLY);
+  } else if (l == "AT+CIPSTATUS") {
+    bool any = false;
+    std::string lines;
+    for (int i = 0; i < MODEM_LINKS; i++) {
+      if (links[i].open) {
+        any = true;
+        lines += "+CIPSTATUS:" + std::to_string(i) + ",\"TCP\",\""
+          + links[i].host + "\"," + std::to_string(links[i].port) + ","
+          + std::to_string(4096 + i) + ",0\r\n";
+      }
+    }
+    out(std::string("STATUS:") + (!joined ? "5" : any ? "3" : "2") + "\r\n");
+    out(lines);
+    out(OK_REPLY);
+  } else if (startsWith(l, "AT+CWJAP_DEF=") || startsWith(l, "AT+CWJAP=")) {
+    busy = true;
+    joined = false;
+    after(joinMicros, [this]() {
+      busy = false;
+      if (offline) {
+        out("+CWJAP:3\r\n\r\nFAIL\r\n"); // Access point not found
+        return;
+      }
+      joined = true;
+      joinedBefore = true;
+      out("WIFI CONNECTED\r\nWIFI GOT IP\r\n");
+      out(OK_REPLY);
+    });
+  } else if (startsWith(l, "AT+CIPSTART=")) {
+    start(l.substr(12));
+  } else if (startsWith(l, "AT+CIPSEND=")) {
+    send(l.substr(11));
+  } else if (startsWith(l, "AT+CIPCLOSE=")) {
+    int link = atoi(l.c_str() + 12);
+    if (link == MODEM_LINKS) {
+      for (int i = 0; i < MODEM_LINKS; i++) {
+        close(i, true);
+      }
+      out(OK_REPLY);
+    } else if (link >= 0 && link < MODEM_LINKS && links[link].open) {
+      close(link, true);
+      out(OK_REPLY);
+    } else {
+      out("UNLINK\r\n");
+      out(ERROR_REPLY);
+    }
+  } else if (startsWith(l, "AT+CIPSERVER=")) {
+    if (!mux) {
+      out(ERROR_REPLY);
+      return;
+    }
+    server = l[13] == '1';
+    out(OK_REPLY);
+  } else if (startsWith(l, "AT+CWSAP=") || startsWith(l, "AT+CIPAP=")
+      || startsWith(l, "AT+CWDHCP=")) {
+    out(OK_REPLY);
+  } else {
+    out(ERROR_REPLY);
+  }
+}
+
+// AT+CIPSTART=<link>,"TCP","<host>",<port>
+void Modem::start(const std::string &args) {
+  int link = -1;
+  int port = 0;
+  char type[8] = "";
+  char host[257] = "";
+  if (!mux || sscanf(args.c_str(), "%d,\"%7[^\"]\",\"%256[^\"]\",%d", &link,
+      type, host, &port) != 4 || link < 0 || link >= MODEM_LINKS) {
+    out(ERROR_REPLY);
+    return;
+  }
+  if (links[link].open) {
+    out("ALREADY CONNECTED\r\n");
+    out(ERROR_REPLY);
+    return;
+  }
+  if (!joined || network == NULL) {
+    out("no ip\r\n");
+    out(ERROR_REPLY);
+    return;
+  }
+  links[link].connecting = true;
+  links[link].dead = false;
+  links[link].host = host;
+  links[link].port = port;
+  busy = true;
+  network->connect(*this, link, host, port);
+}
+
+void Modem::connected(int link, bool ok, uint32_t delayMicros) {
+  after(delayMicros + 2 * faults.latencyMicros, [this, link, ok]() {
+    Link *l = &links[link];
+    if (!l->connecting) {
+      return; // Reset while connecting
+    }
+    l->connecting = false;
+    busy = false;
+    if (ok) {
+      l->open = true;
+      stats.connects++;
+      out(std::to_string(link) + ",CONNECT\r\n");
+      out(OK_REPLY);
+    } else {
+      out(std::to_string(link) + ",CLOSED\r\n");
+      out(ERROR_REPLY);
+    }
+  });
+}
+
+void Modem::accepted(int link) {
+  if (!server || links[link].open) {
+    return;
+  }
+  links[link].open = true;
+  links[link].host = "192.168.4.2";
+  links[link].port = 80;
+  stats.connects++;
+  out(std::to_string(link) + ",CONNECT\r\n");
+}
+
+// AT+CIPSEND=<link>,<length>, answered by a prompt for the data
+void Modem::send(const std::string &args) {
+  int link = -1;
+  int len = 0;
+  if (!mux || sscanf(args.c_str(), "%d,%d", &link, &len) != 2
+      || link < 0 || link >= MODEM_LINKS || len <= 0 || len > 2048) {
+    out(ERROR_REPLY);
+    return;
+  }
+  if (!links[link].open) {
+    out("link is not valid\r\n");
+    out(ERROR_REPLY);
+    return;
+  }
+  out("\r\nOK\r\n> ");
+  mode = DATA;
+  data.clear();
+  dataLeft = len;
+  dataLink = link;
+}
+
+// The last byte of a CIPSEND's data came in.  It reaches the server one
+// way latency later, and SEND OK waits for the acknowledgement to come back.
+void Modem::sent() {
+  mode = COMMAND;
+  out("\r\nRecv " + std::to_string(data.size()) + " bytes\r\n");
+  Link *l = &links[dataLink];
+  if (!l->open || chance(faults.sendFailRate)) {
+    stats.sendFails++;
+    out("\r\nSEND FAIL\r\n");
+    return;
+  }
+  if (chance(faults.dropRate)) {
+    stats.drops++;
+    l->dead = true;
+  }
+  int link = dataLink;
+  std::string d = data;
+  after(faults.latencyMicros, [this, link, d]() {
+    if (links[link].open && !links[link].dead
+        && !network->send(*this, link, d)) {
+      close(link, true); // Reset by the server
+    }
+  });
+  stats.sends++;
+  busy = true;
+  after(ackMicros + 2 * faults.latencyMicros, [this]() {
+    busy = false;
+    out("\r\nSEND OK\r\n");
+  });
+}
+
+void Modem::close(int link, bool reply) {
+  Link *l = &links[link];
+  if (!l->open) {
+    return;
+  }
+  l->open = false;
+  stats.closes++;
+  if (network != NULL) {
+    network->close(*this, link);
+  }
+  if (reply) {
+    out(std::to_string(link) + ",CLOSED\r\n");
+  }
+}
+
+void Modem::received(int link, const std::string &d, uint32_t delayMicros) {
+  for (size_t at = 0; at < d.size(); at += MODEM_FRAME) {
+    std::string frame = d.substr(at, MODEM_FRAME);
+    after(delayMicros + faults.latencyMicros, [this, link, frame]() {
+      if (links[link].open && !links[link].dead) {
+        out("\r\n+IPD," + std::to_string(link) + ","
+            + std::to_string(frame.size()) + ":" + frame);
+      }
+    });
+  }
+}
+
+void Modem::peerClosed(int link, uint32_t delayMicros) {
+  after(delayMicros + faults.latencyMicros, [this, link]() {
+    if (links[link].open && !links[link].dead) {
+      links[link].open = false;
+      stats.closes++;
+      out(std::to_string(link) + ",CLOSED\r\n");
+    }
+  });
+}
+
+bool Modem::isOpen(int link) {
+  return links[link].open;
+}
+
+// Restarts: every connection drops without notice and the modem is deaf
+// until its banner ends in "ready"
+void Modem::boot(bool restore) {
+  for (int i = 0; i < MODEM_LINKS; i++) {
+    close(i, false);
+    links[i].connecting = false;
+  }
+  if (restore) {
+    cwmode = 3;
+    autoConnect = true;
+    joinedBefore = false;
+  }
+  mode = BOOTING;
+  busy = false;
+  joined = false;
+  mux = false;
+  server = false;
+  for (auto e = events.begin(); e != events.end(); ) {
+    e = e->second.world ? std::next(e) : events.erase(e);
+  }
+  after(bootMicros, [this]() {
+    mode = COMMAND;
+    line.clear();
+    out(BOOT_MESSAGE);
+    if (autoConnect && joinedBefore && !offline) {
+      joined = true;
+      out("WIFI CONNECTED\r\nWIFI GOT IP\r\n");
+    }
+  });
+}
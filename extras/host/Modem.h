@@ -0,0 +1,176 @@
+// Emulated ESP8266 on the other end of Serial1.  It speaks the AT commands
+// the library sends, at the speed of a 115200 baud UART, and gets its
+// connections from a Network.  Replies can be scripted to play back
+// failures the real modem gives.
+
+#ifndef Modem_h
+#define Modem_h
+
+#include <deque>
+#include <functional>
+#include <map>
+#include <random>
+#include <string>
+#include <vector>
+#include "Arduino.h"
+
+#define MODEM_LINKS 5
+#define MODEM_FRAME 1460 // Most payload in one +IPD, a TCP segment
+
+class Modem;
+
+// Where the modem's connections go.  It answers through connected(),
+// received() and peerClosed() on the modem, now or later.
+class Network {
+  public:
+    virtual ~Network() {}
+    virtual void connect(Modem &modem, int link, const std::string &host,
+        int port) = 0;
+    // Returns false if the data can't go out, which is SEND FAIL
+    virtual bool send(Modem &modem, int link, const std::string &data) = 0;
+    virtual void close(Modem &modem, int link) = 0;
+    // Called as time passes
+    virtual void poll(Modem &modem) { (void)modem; }
+};
+
+class Modem : public HardwareSerial {
+  public:
+    // Bytes the modem has moved, and what went wrong
+    struct Stats {
+      uint64_t written; // By the library
+      uint64_t delivered; // To the library's receive buffer
+      uint32_t overruns; // Bytes lost to a full receive buffer
+      uint32_t commands;
+      uint32_t connects; // Connections opened
+      uint32_t sends; // CIPSENDs that went out
+      uint32_t sendFails;
+      uint32_t closes; // Connections closed, by either end
+      uint32_t drops; // Sends lost on purpose, see Faults
+    };
+    // Faults to inject, all off by default
+    struct Faults {
+      uint32_t latencyMicros; // Each way between the modem and servers
+      double dropRate; // Sends that get SEND OK but never arrive
+      double sendFailRate; // Sends answered SEND FAIL
+      uint32_t seed; // For the random choices
+    };
+
+    Modem();
+    void reset(); // Powers the modem on again, with its settings
+
+    // The library's end of the UART
+    int available();
+    int read();
+    int peek();
+    using Print::write;
+    size_t write(uint8_t c);
+    size_t write(const uint8_t *buf, size_t len);
+
+    // Moves bytes along the UART and runs what's due, up to host::now()
+    void update();
+    void setNetwork(Network *network);
+    void setFaults(const Faults &faults);
+    // Takes the access point away startMicros from now, for lengthMicros.
+    // Connections drop, and the modem can't join until it's back.
+    void outage(uint32_t startMicros, uint32_t lengthMicros);
+    bool isJoined(); // To the access point
+
+    // Answers commands starting with prefix with reply instead of the usual
+    // one, times times (-1 for always), delayMicros later.  An empty reply
+    // is no answer at all.
+    void script(const char *prefix, const char *reply, int times = -1,
+        uint32_t delayMicros = 0);
+    void clearScript();
+    // Output of the modem's own, such as "WIFI DISCONNECT\r\n"
+    void say(const std::string &text, uint32_t delayMicros = 0);
+    // Puts bytes in the receive buffer at once, without the UART's timing
+    // or size limit.  For benchmarks.
+    void feed(const char *data, size_t len);
+    // Runs fn delayMicros from now, during update()
+    void after(uint32_t delayMicros, const std::function<void()> &fn);
+
+    // The Network's side
+    void connected(int link, bool ok, uint32_t delayMicros = 0);
+    void accepted(int link); // A client connected to the server
+    void received(int link, const std::string &data, uint32_t delayMicros = 0);
+    void peerClosed(int link, uint32_t delayMicros = 0);
+    bool isOpen(int link);
+
+    unsigned long baud; // Of the UART
+    size_t rxBufferSize; // The Teensy's RX_BUFFER_SIZE
+    bool echo; // ATE1, the modem's default
+    uint32_t bootMicros; // AT+RST or AT+RESTORE to "ready"
+    uint32_t joinMicros; // AT+CWJAP_DEF to OK
+    uint32_t ackMicros; // Data out to SEND OK, the TCP acknowledgement
+    Stats stats;
+
+  private:
+    enum Mode {
+      COMMAND, // Reading command lines
+      DATA, // Reading a CIPSEND's data
+      BOOTING // Restarting, deaf
+    };
+    struct Link {
+      bool open;
+      bool connecting;
+      bool dead; // Lost a send, so the server never answers
+      std::string host;
+      int port;
+    };
+    struct Event {
+      std::function<void()> fn;
+      bool world; // Not the modem's own doing, so a restart keeps it
+    };
+    struct Rule {
+      std::string prefix;
+      std::string reply;
+      int times;
+      uint32_t delayMicros;
+    };
+
+    void arrive(char c);
+    void command(const std::string &line);
+    bool runRule(const std::string &line);
+    void start(const std::string &args);
+    void send(const std::string &args);
+    void sent();
+    void close(int link, bool reply);
+    void boot(bool restore);
+    void disconnect();
+    bool chance(double rate);
+    void out(const std::string &text);
+    size_t budget(std::deque<char> &wire, uint64_t &credit, uint64_t elapsed);
+
+    std::deque<char> toModem; // Written by the library, on the wire
+    std::deque<char> fromModem; // Said by the modem, on the wire
+    std::deque<char> rx; // Arrived, waiting for read()
+    uint64_t toCredit;
+    uint64_t fromCredit;
+    uint64_t lastUpdate;
+    std::multimap<uint64_t, Event> events;
+    std::vector<Rule> rules;
+    Network *network;
+    Faults faults;
+    std::mt19937 random;
+    bool offline; // The access point is gone, see outage()
+    Mode mode;
+    bool busy; // A command is still being carried out
+    std::string line;
+    std::string data;
+    size_t dataLeft;
+    int dataLink;
+    Link links[MODEM_LINKS];
+    // Settings kept over a reset, as the real modem keeps them in flash
+    int cwmode;
+    bool autoConnect;
+    bool joinedBefore;
+    // Lost on a reset
+    bool joined;
+    bool mux;
+    bool server;
+};
+
+Modem &hostModem(); // Made on first use, see Serial1 in Arduino.h
+extern Modem &modem;
+
+#endif
@@ -0,0 +1,49 @@
+// Stand-in for Arduino's String, over std::string, with what the library
+// and the harness use
+
+#ifndef String_class_h
+#define String_class_h
+
+#include <string>
+
+class String {
+  public:
+    String() {}
+    String(const char *s) : s(s != NULL ? s : "") {}
+    String(const std::string &s) : s(s) {}
+    explicit String(char c) : s(1, c) {}
+    explicit String(int n) : s(std::to_string(n)) {}
+    explicit String(unsigned int n) : s(std::to_string(n)) {}
+    explicit String(long n) : s(std::to_string(n)) {}
+    explicit String(unsigned long n) : s(std::to_string(n)) {}
+
+    unsigned int length() const { return s.size(); }
+    const char *c_str() const { return s.c_str(); }
+    char operator[](unsigned int i) const { return i < s.size() ? s[i] : 0; }
+    String &operator+=(const String &o) { s += o.s; return *this; }
+    String &operator+=(const char *o) { s += o; return *this; }
+    String &operator+=(char c) { s += c; return *this; }
+    bool operator==(const String &o) const { return s == o.s; }
+    bool operator==(const char *o) const { return s == o; }
+    bool operator!=(const String &o) const { return s != o.s; }
+    bool operator!=(const char *o) const { return s != o; }
+    bool reserve(unsigned int size) { s.reserve(size); return true; }
+
+    friend String operator+(const String &a, const String &b) {
+      return String(a.s + b.s);
+    }
+    friend String operator+(const String &a, const char *b) {
+      return String(a.s + b);
+    }
+    friend String operator+(const char *a, const String &b) {
+      return String(a + b.s);
+    }
+    friend String operator+(const String &a, char b) {
+      return String(a.s + b);
+    }
+
+  private:
+    std::string s;
+};
+
+#endif
@@ -0,0 +1,212 @@
+// Microbenchmarks of the library on the host: what its receive path costs
+// per byte, and what its ticks cost in each state of a request.  The
+// library runs against the emulated modem and a CannedServer, on virtual
+// time, so only the host's own speed changes the results.
+//
+// Usage: bench [requests]
+
+#include "CannedServer.h"
+#include "host.h"
+
+static HttpResponse respond(const HttpRequest &request) {
+  HttpResponse response(200, "Hello from " + request.target);
+  if (request.target == "/stream") {
+    response.length = 1000000000; // The benchmark sends the body itself
+  }
+  return response;
+}
+
+static ESP8266 wifi(0, false);
+static CannedServer server(respond);
+static char streamBuf[STREAMSIZE];
+
+static void drainStream() {
+  while (wifi.readStream(streamBuf, sizeof(streamBuf)) > 0) {
+  }
+}
+
+// Mean cost of a tick with nothing to read
+static double emptyTick() {
+  const int n = 100000;
+  uint64_t start = host::wallNanos();
+  for (int i = 0; i < n; i++) {
+    host::tick(wifi);
+  }
+  return (double)(host::wallNanos() - start) / n;
+}
+
+// Hands text to the library perTick bytes per tick, with the clock
+// stopped, until total bytes have gone.  Returns the ns per byte, less what
+// the ticks would have cost with nothing to read.
+static double parse(const std::string &text, size_t perTick, size_t total,
+    double tickNs, bool stream) {
+  uint64_t ns = 0;
+  size_t at = 0;
+  size_t ticks = 0;
+  for (size_t fed = 0; fed < total; ticks++) {
+    size_t n = text.size() - at < perTick ? text.size() - at : perTick;
+    modem.feed(text.data() + at, n);
+    at = (at + n) % text.size();
+    fed += n;
+    uint64_t start = host::wallNanos();
+    host::tick(wifi);
+    ns += host::wallNanos() - start;
+    if (stream) {
+      drainStream();
+    }
+  }
+  return (ns - ticks * tickNs) / total;
+}
+
+static std::string repeat(const std::string &s, size_t len) {
+  std::string r;
+  while (r.size() < len) {
+    r += s;
+  }
+  return r;
+}
+
+static void parserBenchmarks() {
+  const size_t total = 4 << 20;
+  // AT output with none of the tokens in it, from a status query
+  std::string quiet = repeat("+CIPSTATUS:0,\"TCP\",\"192.168.1.20\",80,4096,0"
+      "\r\n", 64 * 1024);
+  // Replies with a token in every line
+  std::string tokens = repeat("\r\nOK\r\n\r\nSEND OK\r\nERROR\r\n"
+      "STATUS:2\r\nbusy p...\r\n", 64 * 1024);
+  // A streamed response body in whole +IPD frames, as the modem sends it
+  std::string frames = repeat("\r\n+IPD,0,1460:" + std::string(1460, 'x'),
+      64 * 1024);
+
+  double tickNs = emptyTick();
+  printf("Receive path (loadRx, the token matcher behind isTargetInResp and "
+      "+IPD framing)\n");
+  printf("  empty tick: %.1f ns\n", tickNs);
+  printf("  %-28s %14s %14s\n", "input", "12 B/tick", "1024 B/tick");
+  printf("  %-28s %11.2f ns %11.2f ns\n", "AT output, no tokens",
+      parse(quiet, 12, total, tickNs, false),
+      parse(quiet, 1024, total, tickNs, false));
+  printf("  %-28s %11.2f ns %11.2f ns\n", "AT output, token per line",
+      parse(tokens, 12, total, tickNs, false),
+      parse(tokens, 1024, total, tickNs, false));
+
+  // Get a streamed request to the point where its body is coming in
+  if (!wifi.sendStreamRequest(GET, "bench.local", 80, "/stream", "")
+      || !host::runUntil(wifi, [] { return server.requests > 0; }, 5000000)) {
+    printf("  streamed request didn't reach the server\n");
+    return;
+  }
+  host::run(wifi, 2 * server.responseMicros);
+  drainStream();
+  printf("  %-28s %11.2f ns %11.2f ns\n", "+IPD frames, streamed body",
+      parse(frames, 12, total, tickNs, true),
+      parse(frames, 1024, total, tickNs, true));
+  printf("  (12 bytes is what a 1ms tick gets at 115200 baud)\n");
+}
+
+// Runs requests one after another, the way the timer interrupt would, and
+// reports what the ticks cost.  Ticks that wrote to the modem are the ones
+// that moved a request to its next state.
+static void fsmBenchmark(int requests, bool keepAlive) {
+  wifi.setKeepAlive(keepAlive);
+  wifi.resetProfile();
+  wifi.resetTimingStats();
+  uint64_t moveNs = 0;
+  uint32_t moves = 0;
+  uint32_t ticks = 0;
+  uint32_t connects = modem.stats.connects;
+  uint64_t start = host::now();
+  int ok = 0;
+  for (int i = 0; i < requests; i++) {
+    char path[32];
+    snprintf(path, sizeof(path), "/fsm/%d", i);
+    if (!wifi.sendRequest(GET, "bench.local", 80, path, "a=1")) {
+      printf("  request %d rejected\n", i);
+      return;
+    }
+    uint64_t deadline = host::now() + 30000000;
+    while (!wifi.hasResponse() && host::now() < deadline) {
+      host::advance(wifi.getTickMicros());
+      uint64_t written = modem.stats.written;
+      uint64_t t = host::wallNanos();
+      host::tick(wifi);
+      t = host::wallNanos() - t;
+      ticks++;
+      if (modem.stats.written != written) {
+        moveNs += t;
+        moves++;
+      }
+    }
+    if (wifi.hasResponse()) {
+      wifi.getResponse();
+      ok += wifi.getResponseStatus() == 200;
+    }
+  }
+  double seconds = (host::now() - start) / 1e6;
+
+  ESP8266::Profile p;
+  wifi.getProfile(&p);
+  ESP8266::TimingStats timing;
+  wifi.getTimingStats(&timing);
+  printf("\nState machine, %d requests, keep-alive %s: %d ok, %u connections"
+      "\n", requests, keepAlive ? "on" : "off", ok,
+      modem.stats.connects - connects);
+  printf("  %.1f requests/s in virtual time, %.1f ms each, %u ticks each\n",
+      requests / seconds, timing.phases[ESP8266::PHASE_TOTAL].avgMicros / 1e3,
+      ticks / requests);
+  printf("  %u ticks that wrote to the modem: %.0f ns each\n", moves,
+      moves > 0 ? (double)moveNs / moves : 0.0);
+  printf("  %-14s %9s %10s %10s %10s\n", "state", "ticks", "avg ns", "max ns",
+      "rx bytes");
+  for (int row = 0; row < STATEROWS; row++) {
+    const ESP8266::StateProfile *s = &p.states[row];
+    if (wifi.getStateName(row) == NULL || s->ticks == 0) {
+      continue;
+    }
+    printf("  %-14s %9u %10.0f %10u %10u\n", wifi.getStateName(row),
+        s->ticks, (double)s->totalCycles / s->ticks, s->maxCycles, s->rxBytes);
+  }
+}
+
+// Plays back a failure from the modem during one request that asks for
+// auto retry, and reports how long the request took in virtual time
+static void failure(const char *name, const char *prefix, const char *reply) {
+  modem.script(prefix, reply, 1);
+  uint32_t start = millis();
+  wifi.sendRequest(GET, "bench.local", 80, "/retry", "", true);
+  bool done = host::runUntil(wifi, [] { return wifi.hasResponse(); },
+      60000000);
+  wifi.getResponse();
+  printf("  %-34s %s after %lu ms\n", name,
+      done && wifi.getResponseStatus() == 200 ? "ok" : "failed",
+      millis() - start);
+  modem.clearScript();
+}
+
+int main(int argc, char **argv) {
+  int requests = argc > 1 ? atoi(argv[1]) : 500;
+  modem.setNetwork(&server);
+  wifi.begin();
+  if (!host::runUntil(wifi, [] { return !wifi.isStarting(); }, 30000000)
+      || !wifi.isStartupOk()) {
+    printf("Startup failed\n");
+    return 1;
+  }
+  wifi.connectWifi("bench", "password");
+  if (!host::runUntil(wifi, [] { return wifi.isConnected(); }, 30000000)) {
+    printf("Couldn't join the network\n");
+    return 1;
+  }
+  fsmBenchmark(requests, false);
+  fsmBenchmark(requests, true);
+  printf("\nScripted failures, each once, with auto retry\n");
+  wifi.setKeepAlive(false);
+  failure("connection refused", "AT+CIPSTART=",
+      "0,CLOSED\r\n\r\nERROR\r\n");
+  failure("no answer to CIPSTART", "AT+CIPSTART=", "");
+  failure("CIPSEND refused", "AT+CIPSEND=", "\r\nERROR\r\n");
+  failure("busy modem", "AT+CIPSTART=", "busy p...\r\n\r\nERROR\r\n");
+  printf("\n");
+  parserBenchmarks();
+  return 0;
+}
@@ -0,0 +1,240 @@
+// Checks of the library's receive path against the emulated modem, on
+// virtual time.  Exits with 1 if any fails.
+//
+// - Submits that are rejected, which mustn't print without serialYes, since
+//   they can be made from other interrupt handlers
+// - An upload with the longest domain and path, which must be refused if
+//   its head doesn't fit in DATASIZE
+// - Link notices ("+IPD," and "<id>,CLOSED") split across a clear of the AT
+//   command output, which the FSMs do whenever a command finishes
+// - Access point clients sending their requests at the same time
+//
+// Usage: checks [rounds]
+
+#include <random>
+#include "CannedServer.h"
+#include "host.h"
+
+static HttpResponse respond(const HttpRequest &request) {
+  return HttpResponse(200, "Hello from " + request.target);
+}
+
+static CannedServer server(respond);
+static ESP8266 *wifi;
+static int failures = 0;
+
+static void report(const char *name, bool ok, const std::string &detail) {
+  printf("  %-44s %s%s\n", name, ok ? "ok" : "FAILED", detail.c_str());
+  failures += !ok;
+}
+
+// Gets a request to where it waits for its response, with the command
+// channel free, then plays back a CIPSTATUS reply that ends partway into a
+// notice and the rest of the notice after it.  Clearing the reply must not
+// lose the notice, which completes the response.
+static void splitNotice(const char *name, const std::string &before,
+    const char *reply, const std::string &rest) {
+  if (!wifi->sendRequest(GET, "checks.local", 80, "/split", "")
+      || !host::runUntil(*wifi, [] { return server.requests > 0; }, 5000000)) {
+    report(name, false, ", request didn't reach the server");
+    return;
+  }
+  server.requests = 0;
+  host::run(*wifi, 100000); // SEND OK
+  modem.say(before);
+  modem.script("AT+CIPSTATUS", reply, 1);
+  modem.say(rest, 100000);
+  wifi->connectWifi("checks", "password"); // Checks the status right away
+  bool done = host::runUntil(*wifi, [] { return wifi->hasResponse(); },
+      2000000);
+  String body = wifi->getResponse();
+  modem.clearScript();
+  report(name, done && body == "split" && wifi->getResponseStatus() == 200,
+      done ? "" : ", no response");
+}
+
+// Runs submit, which must be rejected without writing to Serial
+static void quietReject(const char *name, const std::function<bool()> &submit) {
+  size_t before = host::consoleBytes;
+  bool accepted = submit();
+  size_t printed = host::consoleBytes - before;
+  host::run(*wifi, 10000); // Lets the library drop what was aborted
+  report(name, !accepted && printed == 0, accepted ? ", accepted"
+      : printed > 0 ? ", printed " + std::to_string(printed) + " bytes" : "");
+}
+
+static void rejectedSubmits() {
+  std::string domain(DOMAINSIZE, 'd');
+  quietReject("request type", [] {
+    return wifi->sendRequest(3, "checks.local", 80, "/", "");
+  });
+  quietReject("domain too long", [&domain] {
+    return wifi->sendRequest(GET, domain.c_str(), 80, "/", "");
+  });
+  quietReject("request already being built", [] {
+    bool second = wifi->beginRequest(GET, "checks.local", 80, "/")
+      && wifi->beginRequest(GET, "checks.local", 80, "/");
+    wifi->abortRequest();
+    return second;
+  });
+  quietReject("built request too long", [] {
+    std::string data(CIPSEND_MAX, 'x');
+    return wifi->beginRequest(POST, "checks.local", 80, "/")
+      && (wifi->appendData(data.c_str(), data.size()), wifi->submitRequest());
+  });
+#if ESP_STREAMING
+  quietReject("streamed request too long", [&domain] {
+    return wifi->sendStreamRequest(GET, domain.c_str(), 80, "/", "");
+  });
+#endif
+#if ESP_UPLOADS
+  quietReject("upload too long", [&domain] {
+    return wifi->sendBigRequest(domain.c_str(), 80, "/", "{}", 2);
+  });
+#endif
+}
+
+static void longUpload() {
+  std::string domain(DOMAINSIZE - 1, 'd');
+  std::string path = "/" + std::string(PATHSIZE - 2, 'p');
+  bool fits = HTTP_UPLOAD_FIXED_LEN + domain.size() + 2 + path.size()
+    <= DATASIZE;
+  bool sent = wifi->sendBigRequest(domain.c_str(), 80, path.c_str(), "{}", 2);
+  bool answered = sent
+    && host::runUntil(*wifi, [] { return wifi->hasResponse(); }, 5000000)
+    && wifi->getResponse() == ("Hello from " + path).c_str()
+    && wifi->getResponseStatus() == 200;
+  report("longest domain and path", sent == fits && answered == fits,
+      fits ? ", sent" : ", refused");
+}
+
+static void stationChecks() {
+  wifi = new ESP8266(0, false);
+  modem.setNetwork(&server);
+  wifi->begin();
+  if (!host::runUntil(*wifi, [] { return !wifi->isStarting(); }, 30000000)
+      || !wifi->isStartupOk()) {
+    report("station startup", false, "");
+    return;
+  }
+  wifi->connectWifi("checks", "password");
+  if (!host::runUntil(*wifi, [] { return wifi->isConnected(); }, 30000000)) {
+    report("joining the network", false, "");
+    return;
+  }
+  printf("Rejected submits\n");
+  rejectedSubmits();
+
+  printf("\nUploads\n");
+  longUpload();
+
+  printf("\nNotices split across a clear\n");
+  server.responseMicros = 60000000; // The checks answer instead
+  std::string response = HttpResponse(200, "split").text();
+  splitNotice("\"+IPD,\" split", "", "STATUS:3\r\n\r\nOK\r\n\r\n+IP",
+      "D,0," + std::to_string(response.size()) + ":" + response);
+  // A response without a length ends when the server closes
+  response = "HTTP/1.0 200 OK\r\n\r\nsplit";
+  splitNotice("\"0,CLOSED\" split",
+      "\r\n+IPD,0," + std::to_string(response.size()) + ":" + response,
+      "STATUS:3\r\n\r\nOK\r\n0,", "CLOSED\r\n");
+}
+
+// Clients of the access point: they connect and send a request whenever
+// told to, and collect what the modem sends them until it closes them
+class Clients : public Network {
+  public:
+    void connect(Modem &modem, int link, const std::string &host, int port) {
+      (void)host;
+      (void)port;
+      modem.connected(link, false);
+    }
+    bool send(Modem &modem, int link, const std::string &data) {
+      (void)modem;
+      got[link] += data;
+      return true;
+    }
+    void close(Modem &modem, int link) {
+      (void)modem;
+      closed[link] = true;
+    }
+
+    std::string got[MODEM_LINKS];
+    bool closed[MODEM_LINKS];
+};
+
+static Clients clients;
+
+static bool allClosed(int n) {
+  ESP8266::APRequest request;
+  while (wifi->getRequest(&request)) {
+    wifi->releaseRequest();
+  }
+  for (int k = 0; k < n; k++) {
+    if (!clients.closed[k]) {
+      return false;
+    }
+  }
+  return true;
+}
+
+// Rounds of n clients, each asking for the same page within 5ms of the
+// others.  A client is served if it gets the whole page and is closed.
+static void concurrentClients(int n, int rounds, const std::string &page) {
+  std::minstd_rand random(n);
+  int served = 0;
+  int stuck = 0;
+  for (int round = 0; round < rounds; round++) {
+    for (int k = 0; k < n; k++) {
+      clients.got[k].clear();
+      clients.closed[k] = false;
+      modem.after(random() % 5000, [k]() {
+        modem.accepted(k);
+        modem.received(k, "GET /page HTTP/1.1\r\nHost: 192.168.4.1\r\n\r\n");
+      });
+    }
+    host::runUntil(*wifi, [n] { return allClosed(n); }, 30000000);
+    for (int k = 0; k < n; k++) {
+      if (clients.closed[k]) {
+        served += clients.got[k].find(page) != std::string::npos;
+      } else {
+        stuck++;
+        modem.peerClosed(k); // Give up on it, so its link can be used again
+      }
+    }
+    host::run(*wifi, 100000);
+  }
+  char name[48];
+  snprintf(name, sizeof(name), "%d client%s at a time", n, n > 1 ? "s" : "");
+  char detail[64];
+  snprintf(detail, sizeof(detail), ", %d/%d served, %d stuck", served,
+      n * rounds, stuck);
+  report(name, served == n * rounds, detail);
+}
+
+static void accessPointChecks(int rounds) {
+  printf("\nAccess point clients\n");
+  delete wifi;
+  wifi = new ESP8266(1, false);
+  modem.setNetwork(&clients);
+  wifi->begin();
+  if (!host::runUntil(*wifi, [] { return !wifi->isStarting(); }, 30000000)
+      || !wifi->startserver("checks", "password")
+      || !host::runUntil(*wifi, [] { return !wifi->isStarting(); }, 30000000)
+      || !wifi->isStartupOk()) {
+    report("access point startup", false, "");
+    return;
+  }
+  std::string page(1500, 'p');
+  wifi->setPage("/page", page.c_str());
+  concurrentClients(1, rounds, page);
+  concurrentClients(2, rounds, page);
+  concurrentClients(MODEM_LINKS, rounds, page);
+}
+
+int main(int argc, char **argv) {
+  int rounds = argc > 1 ? atoi(argv[1]) : 200;
+  stationChecks();
+  accessPointChecks(rounds);
+  return failures > 0 ? 1 : 0;
+}
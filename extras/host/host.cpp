@@ -0,0 +1,189 @@
+#include <time.h>
+#include <unistd.h>
+#include "host.h"
+#include "Modem.h"
+
+HostConsole Serial;
+
+HardwareSerial &hostSerial1() {
+  return hostModem();
+}
+
+bool host::console = false;
+bool host::realTime = false;
+size_t host::consoleBytes = 0;
+
+static uint64_t virtualMicros = 0;
+static uint64_t wallStart = host::wallNanos();
+static bool inTick = false;
+
+uint64_t host::wallNanos() {
+  struct timespec ts;
+  clock_gettime(CLOCK_MONOTONIC, &ts);
+  return (uint64_t)ts.tv_sec * 1000000000 + ts.tv_nsec;
+}
+
+uint64_t host::now() {
+  return virtualMicros;
+}
+
+// With realTime, waits for the wall clock to catch up.  A run that falls
+// behind isn't slowed further, and catches up when it can.
+void host::advance(uint32_t us) {
+  virtualMicros += us;
+  if (realTime) {
+    uint64_t wall = (wallNanos() - wallStart) / 1000;
+    if (wall < virtualMicros) {
+      usleep(virtualMicros - wall);
+    }
+  }
+  hostModem().update();
+}
+
+bool host::ticking() {
+  return inTick;
+}
+
+void host::tick(ESP8266 &esp) {
+  inTick = true;
+  esp.tick();
+  inTick = false;
+}
+
+void host::run(ESP8266 &esp, uint32_t us) {
+  uint64_t end = virtualMicros + us;
+  while (virtualMicros < end) {
+    advance(esp.getTickMicros());
+    tick(esp);
+  }
+}
+
+bool host::runUntil(ESP8266 &esp, const std::function<bool()> &done,
+    uint32_t us) {
+  uint64_t end = virtualMicros + us;
+  while (!done() && virtualMicros < end) {
+    advance(esp.getTickMicros());
+    tick(esp);
+  }
+  return done();
+}
+
+unsigned long millis() {
+  return virtualMicros / 1000;
+}
+
+unsigned long micros() {
+  return virtualMicros;
+}
+
+void delay(unsigned long ms) {
+  host::advance(ms * 1000);
+}
+
+void yield() {
+}
+
+uint32_t hostCycles() {
+  return host::wallNanos();
+}
+
+size_t Print::write(const uint8_t *buf, size_t len) {
+  for (size_t i = 0; i < len; i++) {
+    write(buf[i]);
+  }
+  return len;
+}
+
+size_t Print::print(const char *s) {
+  return write((const uint8_t *)s, strlen(s));
+}
+
+size_t Print::print(char c) {
+  return write((uint8_t)c);
+}
+
+size_t Print::print(const String &s) {
+  return write((const uint8_t *)s.c_str(), s.length());
+}
+
+size_t Print::print(int n, int base) {
+  return print((long)n, base);
+}
+
+size_t Print::print(unsigned int n, int base) {
+  return print((unsigned long)n, base);
+}
+
+size_t Print::print(long n, int base) {
+  char t[24];
+  if (base == HEX) {
+    snprintf(t, sizeof(t), "%lX", (unsigned long)n);
+  } else {
+    snprintf(t, sizeof(t), "%ld", n);
+  }
+  return print(t);
+}
+
+size_t Print::print(unsigned long n, int base) {
+  char t[24];
+  snprintf(t, sizeof(t), base == HEX ? "%lX" : "%lu", n);
+  return print(t);
+}
+
+size_t Print::print(double n) {
+  char t[32];
+  snprintf(t, sizeof(t), "%.2f", n);
+  return print(t);
+}
+
+size_t Print::println() {
+  return print("\r\n");
+}
+
+size_t Print::println(const char *s) {
+  return print(s) + println();
+}
+
+size_t Print::println(char c) {
+  return print(c) + println();
+}
+
+size_t Print::println(const String &s) {
+  return print(s) + println();
+}
+
+size_t Print::println(int n, int base) {
+  return print(n, base) + println();
+}
+
+size_t Print::println(unsigned int n, int base) {
+  return print(n, base) + println();
+}
+
+size_t Print::println(long n, int base) {
+  return print(n, base) + println();
+}
+
+size_t Print::println(unsigned long n, int base) {
+  return print(n, base) + println();
+}
+
+size_t Print::println(double n) {
+  return print(n) + println();
+}
+
+size_t HostConsole::write(uint8_t c) {
+  host::consoleBytes++;
+  if (host::console) {
+    putchar(c);
+  }
+  return 1;
+}
+
+size_t HostConsole::write(const uint8_t *buf, size_t len) {
+  host::consoleBytes += len;
+  if (host::console) {
+    fwrite(buf, 1, len, stdout);
+  }
+  return len;
+}
@@ -0,0 +1,31 @@
+// Virtual clock and tick loop of the host build.  Nothing moves on its own:
+// advance() moves the clock and, with it, the emulated modem's UART and
+// network events, and run() also ticks the library the way its timer would.
+
+#ifndef host_h
+#define host_h
+
+#include <functional>
+#include "Wifi_S08_v2.h"
+
+namespace host {
+  extern bool console; // Print the library's Serial output to stdout
+  extern size_t consoleBytes; // Written to Serial so far, printed or not
+  extern bool realTime; // Pace virtual time to the wall clock, for sockets
+
+  uint64_t now(); // Virtual microseconds since start
+  void advance(uint32_t us);
+  bool ticking(); // Inside ESP8266::tick()
+
+  // Ticks esp every getTickMicros() for us microseconds
+  void run(ESP8266 &esp, uint32_t us);
+  // Ticks esp until done() is true, or for at most us microseconds.
+  // Returns done().
+  bool runUntil(ESP8266 &esp, const std::function<bool()> &done, uint32_t us);
+  // One tick of esp, without moving the clock
+  void tick(ESP8266 &esp);
+
+  uint64_t wallNanos(); // Host monotonic clock
+}
+
+#endif
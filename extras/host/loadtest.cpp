@@ -0,0 +1,348 @@
+// End-to-end load test.  The library makes real HTTP requests to a server on
+// 127.0.0.1 through the emulated modem, its 115200 baud UART and loopback
+// sockets, in real time.  Reports requests per second, latency
+// percentiles, what failed, and how long the library took to get requests
+// through again after an outage.
+//
+// Usage: loadtest [options]
+//   -n N       requests per run (200)
+//   -r RATE    offer a request RATE times a second, counting the ones the
+//              full queue rejects; without it, each goes as soon as the
+//              library takes it
+//   -k MODE    keep-alive off, on or both (both)
+//   -u BYTES   POST BYTES bodies with sendBigRequest() instead of GETs
+//   -B BYTES   response body size (64)
+//   -S MS[,MAX]  server think time, or a random one between MS and MAX (0)
+//   -p PORT    use the server on 127.0.0.1:PORT instead of the built-in one
+//   -l MS      latency each way between the modem and the server (0)
+//   -d RATE    fraction of sends lost without a trace (0)
+//   -f RATE    fraction of sends answered SEND FAIL (0)
+//   -o AT,LEN  take the access point away for LEN seconds, AT seconds into
+//              each run
+//   -A         don't ask for auto retry (uploads never do)
+//   -s SEED    random seed for the faults (1)
+//   -v         the library's verbose output
+
+#include <algorithm>
+#include <arpa/inet.h>
+#include <deque>
+#include <netinet/in.h>
+#include <random>
+#include <sys/socket.h>
+#include <thread>
+#include <unistd.h>
+#include <vector>
+#include "Http.h"
+#include "Loopback.h"
+#include "host.h"
+
+static ESP8266 *wifi;
+static int requests = 200;
+static double rate = 0;
+static const char *keepAliveMode = "both";
+static size_t uploadBytes = 0;
+static std::string uploadBody;
+static size_t responseBytes = 64;
+static int serverMillis = 0;
+static int serverMaxMillis = 0;
+static int port = 0;
+static double outageAt = 0;
+static double outageLength = 0;
+static bool autoRetry = true;
+static uint64_t settled = 0; // When the last run's outage is over
+
+// What the built-in server answers for path: "ok " and path, padded to
+// responseBytes, so a response can be matched to its request
+static std::string bodyFor(const std::string &path) {
+  std::string body = "ok " + path + "\n";
+  if (body.size() < responseBytes) {
+    body.resize(responseBytes, '.');
+  }
+  return body;
+}
+
+static void serve(int fd) {
+  HttpRequestParser parser;
+  std::minstd_rand random(fd);
+  char buf[4096];
+  ssize_t n;
+  bool open = true;
+  while (open && (n = recv(fd, buf, sizeof(buf), 0)) > 0) {
+    for (ssize_t i = 0; i < n && open; i++) {
+      if (!parser.feed(buf[i])) {
+        continue;
+      }
+      const std::string &target = parser.request.target;
+      HttpResponse response(200, bodyFor(target.substr(0, target.find('?'))));
+      response.close = parser.request.close;
+      int millis = serverMillis;
+      if (serverMaxMillis > serverMillis) {
+        millis += random() % (serverMaxMillis - serverMillis + 1);
+      }
+      if (millis > 0) {
+        usleep(millis * 1000);
+      }
+      std::string text = response.text();
+      open = ::send(fd, text.data(), text.size(), MSG_NOSIGNAL)
+        == (ssize_t)text.size() && !response.close;
+    }
+  }
+  close(fd);
+}
+
+// Listens on an unused port of 127.0.0.1, with a thread per connection.
+// Returns the port.
+static int startServer() {
+  int fd = socket(AF_INET, SOCK_STREAM, 0);
+  struct sockaddr_in addr;
+  memset(&addr, 0, sizeof(addr));
+  addr.sin_family = AF_INET;
+  addr.sin_addr.s_addr = htonl(INADDR_LOOPBACK);
+  socklen_t len = sizeof(addr);
+  if (bind(fd, (struct sockaddr *)&addr, sizeof(addr)) < 0
+      || listen(fd, 16) < 0
+      || getsockname(fd, (struct sockaddr *)&addr, &len) < 0) {
+    perror("server");
+    exit(1);
+  }
+  std::thread([fd]() {
+    for (;;) {
+      int c = accept(fd, NULL, NULL);
+      if (c >= 0) {
+        std::thread(serve, c).detach();
+      }
+    }
+  }).detach();
+  return ntohs(addr.sin_port);
+}
+
+static double percentile(const std::vector<double> &sorted, double p) {
+  if (sorted.empty()) {
+    return 0;
+  }
+  size_t rank = (size_t)(p / 100 * sorted.size() + 0.999999);
+  return sorted[rank > 0 ? rank - 1 : 0];
+}
+
+struct Pending {
+  int id;
+  uint64_t sent; // Accepted by the library, in host::now() micros
+};
+
+static void runLoad(int run, bool keepAlive) {
+  // A run that failed fast can end before its outage does, and the library
+  // only finds out it left the network at its next CIPSTATUS
+  host::runUntil(*wifi, [] {
+    return host::now() >= settled && modem.isJoined() && wifi->isConnected();
+  }, 60000000);
+  wifi->setKeepAlive(keepAlive);
+  wifi->resetTimingStats();
+  wifi->resetMetrics();
+  Modem::Stats before = modem.stats;
+  uint64_t start = host::now();
+  uint64_t outageEnd = 0;
+  if (outageLength > 0) {
+    modem.outage(outageAt * 1e6, outageLength * 1e6);
+    outageEnd = start + (uint64_t)((outageAt + outageLength) * 1e6);
+    settled = outageEnd;
+  }
+  std::deque<Pending> pending;
+  std::vector<double> latencies;
+  int offered = 0;
+  int rejected = 0;
+  int bad = 0;
+  int wrong = 0;
+  uint64_t nextOffer = start;
+  uint64_t lastDone = start;
+  uint64_t longestGap = 0;
+  uint64_t recovered = 0;
+  uint64_t deadline = start + 600000000;
+  while (host::now() < deadline) {
+    uint64_t now = host::now();
+    if (offered < requests && (rate == 0 || now >= nextOffer)) {
+      char path[48];
+      snprintf(path, sizeof(path), "/load/%d/%d", run, offered);
+      bool ok = uploadBytes > 0
+        ? wifi->sendBigRequest("loopback", port, path, uploadBody.data(),
+            uploadBytes)
+        : wifi->sendRequest(GET, "loopback", port, path, "", autoRetry);
+      if (ok) {
+        Pending p = {offered, now};
+        pending.push_back(p);
+      } else if (rate > 0) {
+        rejected++;
+      }
+      if (ok || rate > 0) {
+        offered++;
+        nextOffer += 1e6 / rate;
+      }
+    }
+    while (wifi->hasResponse()) {
+      String body = wifi->getResponse();
+      int r = -1;
+      int id = -1;
+      sscanf(body.c_str(), "ok /load/%d/%d", &r, &id);
+      auto p = pending.begin();
+      while (p != pending.end() && r == run && p->id != id) {
+        ++p;
+      }
+      if (r != run || p == pending.end()) {
+        if (pending.empty()) {
+          continue;
+        }
+        p = pending.begin(); // Not one of ours, so take the oldest
+      }
+      char path[48];
+      snprintf(path, sizeof(path), "/load/%d/%d", run, p->id);
+      if (wifi->getResponseStatus() != 200) {
+        bad++;
+      } else if (body.c_str() != bodyFor(path)) {
+        wrong++;
+      }
+      latencies.push_back((now - p->sent) / 1e3);
+      pending.erase(p);
+      longestGap = std::max(longestGap, now - lastDone);
+      lastDone = now;
+      if (outageEnd != 0 && recovered == 0 && now >= outageEnd) {
+        recovered = now;
+      }
+    }
+    if (offered == requests && (pending.empty() || !wifi->isBusy())) {
+      break; // What's left of pending failed
+    }
+    host::advance(wifi->getTickMicros());
+    host::tick(*wifi);
+  }
+  double seconds = (host::now() - start) / 1e6;
+
+  std::sort(latencies.begin(), latencies.end());
+  printf("\nKeep-alive %s: %d offered, %zu answered (%d not 200, %d wrong "
+      "body), %zu failed, %d rejected\n", keepAlive ? "on" : "off", offered,
+      latencies.size(), bad, wrong, pending.size(), rejected);
+  printf("  %.2f requests/s over %.1f s\n", latencies.size() / seconds,
+      seconds);
+  printf("  latency ms: p50 %.1f  p90 %.1f  p99 %.1f  max %.1f\n",
+      percentile(latencies, 50), percentile(latencies, 90),
+      percentile(latencies, 99), percentile(latencies, 100));
+  printf("  modem: %u connections, %u sends, %u SEND FAIL, %u lost, "
+      "%u UART overruns\n", modem.stats.connects - before.connects,
+      modem.stats.sends - before.sends,
+      modem.stats.sendFails - before.sendFails,
+      modem.stats.drops - before.drops,
+      modem.stats.overruns - before.overruns);
+
+  ESP8266::TimingStats timing;
+  wifi->getTimingStats(&timing);
+  static const char * const PHASES[] = {
+    "queue", "connect", "prompt", "send", "server", "receive", "total"
+  };
+  printf("  phases, avg/p99 ms:");
+  for (int i = 0; i < ESP8266::NUMBEROFPHASES; i++) {
+    const ESP8266::PhaseStats *s = &timing.phases[i];
+    printf(" %s %.1f/%.1f", PHASES[i], s->avgMicros / 1e3,
+        s->p99Micros / 1e3);
+  }
+  printf("\n");
+
+  ESP8266::Metrics metrics;
+  wifi->getMetrics(&metrics);
+  static const char * const CAUSES[] = {
+    "timeout", "error", "send fail", "closed", "overflow", "retry",
+    "reconnect", "cipstatus"
+  };
+  printf("  library failures:");
+  for (int i = 0; i < ESP8266::NUMBEROFCAUSES; i++) {
+    uint32_t n = 0;
+    for (int row = 0; row < STATEROWS; row++) {
+      n += metrics.counts[i][row];
+    }
+    if (n > 0) {
+      printf(" %s %u", CAUSES[i], n);
+    }
+  }
+  printf("\n");
+  if (outageEnd != 0) {
+    if (recovered != 0) {
+      printf("  recovery: first response %.1f s after the outage ended\n",
+          (recovered - outageEnd) / 1e6);
+    } else {
+      printf("  recovery: no response after the outage\n");
+    }
+  }
+  printf("  longest wait between responses: %.1f s\n", longestGap / 1e6);
+}
+
+int main(int argc, char **argv) {
+  Modem::Faults faults;
+  memset(&faults, 0, sizeof(faults));
+  faults.seed = 1;
+  bool verbose = false;
+  int opt;
+  while ((opt = getopt(argc, argv, "n:r:k:u:B:S:p:l:d:f:o:As:v")) != -1) {
+    switch (opt) {
+      case 'n': requests = atoi(optarg); break;
+      case 'r': rate = atof(optarg); break;
+      case 'k': keepAliveMode = optarg; break;
+      case 'u': uploadBytes = atol(optarg); break;
+      case 'B': responseBytes = atol(optarg); break;
+      case 'S':
+        if (sscanf(optarg, "%d,%d", &serverMillis, &serverMaxMillis) < 1) {
+          fprintf(stderr, "-S takes MS or MS,MAX\n");
+          return 2;
+        }
+        break;
+      case 'p': port = atoi(optarg); break;
+      case 'l': faults.latencyMicros = atof(optarg) * 1000; break;
+      case 'd': faults.dropRate = atof(optarg); break;
+      case 'f': faults.sendFailRate = atof(optarg); break;
+      case 'o':
+        if (sscanf(optarg, "%lf,%lf", &outageAt, &outageLength) != 2) {
+          fprintf(stderr, "-o takes AT,LEN in seconds\n");
+          return 2;
+        }
+        break;
+      case 'A': autoRetry = false; break;
+      case 's': faults.seed = atoi(optarg); break;
+      case 'v': verbose = true; break;
+      default:
+        fprintf(stderr, "See the top of loadtest.cpp for the options\n");
+        return 2;
+    }
+  }
+  if (port == 0) {
+    port = startServer();
+  }
+  uploadBody.assign(uploadBytes, 'u');
+
+  host::realTime = true;
+  host::console = verbose;
+  static LoopbackNetwork network;
+  modem.setNetwork(&network);
+  modem.setFaults(faults);
+  wifi = new ESP8266(0, verbose);
+  wifi->begin();
+  if (!host::runUntil(*wifi, [] { return !wifi->isStarting(); }, 30000000)
+      || !wifi->isStartupOk()) {
+    printf("Startup failed\n");
+    return 1;
+  }
+  wifi->connectWifi("loadtest", "password");
+  if (!host::runUntil(*wifi, [] { return wifi->isConnected(); }, 30000000)) {
+    printf("Couldn't join the network\n");
+    return 1;
+  }
+  printf("%d requests per run to 127.0.0.1:%d, %s", requests, port,
+      uploadBytes > 0 ? "sendBigRequest() uploads" : "sendRequest() GETs");
+  if (rate > 0) {
+    printf(" offered at %.1f/s", rate);
+  }
+  printf("\n");
+  int run = 0;
+  if (strcmp(keepAliveMode, "on") != 0) {
+    runLoad(run++, false);
+  }
+  if (strcmp(keepAliveMode, "off") != 0) {
+    runLoad(run++, true);
+  }
+  return 0;
+}